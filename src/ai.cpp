@@ -17,23 +17,34 @@
     along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstring>
-#include <queue>
-#include <thread>
-#include <vector>
 
 #include "ai.h"
 #include "core.h"
 #include "log.h"
 #include "memory.h"
 #include "mi.h"
+#include "pacer.h"
 #include "settings.h"
+#include "shm.h"
 
-#define MAX_BUFFERS 4
 #define SAMPLE_COUNT 1024
 #define OUTPUT_RATE 48000
-#define OUTPUT_SIZE SAMPLE_COUNT * sizeof(uint32_t)
+
+#define RING_SIZE 0x2000
+#define MAX_INPUT 0x10000
+#define MAX_TAPS 16
+#define PHASES 256
+#define CHUNK_SIZE 0x100
+#define PI 3.14159265358979323846
 
 struct Samples
 {
@@ -43,41 +54,56 @@ struct Samples
 
 namespace AI
 {
-    uint32_t bufferOut[SAMPLE_COUNT];
-    std::atomic<bool> ready;
-
     Samples samples[2];
-    std::queue<std::vector<uint32_t>> buffers;
-    uint32_t offset;
+
+    // Resampled stereo samples are queued in a fixed ring, written by the emulator and read by the audio thread
+    uint32_t ring[RING_SIZE];
+    std::atomic<uint32_t> ringHead;
+    std::atomic<uint32_t> ringTail;
+    uint32_t lastSample;
+
+    // Input samples are converted to interleaved stereo floats, following the last few from the previous DMA
+    // The resampler position is 32.32 fixed-point, in input samples from the start of that history
+    alignas(16) float input[(MAX_TAPS + MAX_INPUT) * 2];
+    alignas(16) float kernel[PHASES][MAX_TAPS * 2];
+    uint64_t position;
+    uint32_t taps;
+    uint32_t kernelRate;
+    int kernelType;
 
     uint32_t dramAddr;
     uint32_t control;
     uint32_t frequency;
     uint32_t status;
 
-    void createBuffer();
+    void buildKernel();
+    void convertInput(uint32_t address, uint32_t count);
+    uint32_t resample(const float *in, const float *coeffs);
+    void queueSamples(const uint32_t *values, uint32_t count);
+    void syncOutput();
     void submitBuffer();
     void processBuffer();
 }
 
 void AI::fillBuffer(uint32_t *out)
 {
-    // Try to wait until a buffer is ready, but don't stall the audio callback too long
-    std::chrono::steady_clock::time_point waitTime = std::chrono::steady_clock::now();
-    while (!ready.load())
-    {
-        if (std::chrono::steady_clock::now() - waitTime > std::chrono::microseconds(1000000 / 60))
-        {
-            // If a buffer isn't ready in time, fill the output with the last played sample
-            for (int i = 0; i < SAMPLE_COUNT; i++)
-                out[i] = bufferOut[SAMPLE_COUNT - 1];
-            return;
-        }
-    }
-
-    // Output the buffer and mark it as used
-    memcpy(out, bufferOut, OUTPUT_SIZE);
-    ready.store(false);
+    // Give the emulator a little time to catch up if it's behind, but don't stall the audio callback too long
+    Pacer::waitConsume(SAMPLE_COUNT, std::chrono::microseconds(1000000 / 60));
+
+    // Output as many samples as are queued, and fill the rest with the last played sample
+    uint32_t tail = ringTail.load(std::memory_order_relaxed);
+    uint32_t queued = ringHead.load(std::memory_order_acquire) - tail;
+    uint32_t count = std::min<uint32_t>(queued, SAMPLE_COUNT);
+    uint32_t first = std::min<uint32_t>(count, RING_SIZE - (tail % RING_SIZE));
+    memcpy(out, &ring[tail % RING_SIZE], first * sizeof(uint32_t));
+    memcpy(&out[first], ring, (count - first) * sizeof(uint32_t));
+    if (count) lastSample = out[count - 1];
+    for (uint32_t i = count; i < SAMPLE_COUNT; i++)
+        out[i] = lastSample;
+    ringTail.store(tail + count, std::memory_order_release);
+
+    // Let the emulator continue, and report what's left for rate control
+    Pacer::consume(SAMPLE_COUNT, queued - count);
 }
 
 void AI::reset()
@@ -88,8 +114,16 @@ void AI::reset()
     frequency = 0;
     status = 0;
 
-    // Schedule the first audio buffer to output
-    Core::schedule(createBuffer, (uint64_t)SAMPLE_COUNT * (93750000 * 2) / OUTPUT_RATE);
+    // Empty the ring and rebuild the resampler on the first submission
+    ringHead.store(0);
+    ringTail.store(0);
+    memset(input, 0, sizeof(input));
+    kernelRate = 0;
+    lastSample = 0;
+
+    // Schedule the first sync with the audio output
+    Pacer::reset(OUTPUT_RATE);
+    Core::schedule(syncOutput, (uint64_t)SAMPLE_COUNT * (93750000 * 2) / OUTPUT_RATE);
 }
 
 uint32_t AI::read(uint32_t address)
@@ -159,41 +193,121 @@ void AI::write(uint32_t address, uint32_t value)
     }
 }
 
-void AI::createBuffer()
+void AI::buildKernel()
 {
-    // Wait until the previous buffer has been used
-    while (Settings::fpsLimiter && Core::running && ready.load())
-        std::this_thread::yield();
+    // Use 2 taps for linear interpolation, or 16 for a Blackman-windowed sinc
+    kernelRate = frequency;
+    kernelType = Settings::audioFilter;
+    taps = kernelType ? MAX_TAPS : 2;
 
-    memset(bufferOut, 0, OUTPUT_SIZE);
-    size_t count = 0;
+    // Lower the cutoff when downsampling, so frequencies past the output's limit don't alias
+    double cutoff = std::min(1.0, (double)OUTPUT_RATE / frequency) * 0.95;
 
-    while (!buffers.empty() && count < OUTPUT_SIZE)
+    for (int phase = 0; phase < PHASES; phase++)
     {
-        // Get the current queued buffer and the size of its remaining samples
-        std::vector<uint32_t> &buffer = buffers.front();
-        size_t size = (buffer.size() - offset) * sizeof(uint32_t);
-
-        if (size <= OUTPUT_SIZE - count)
-        {
-            // Copy all of the remaining queued samples to the output buffer
-            memcpy(&bufferOut[count / sizeof(uint32_t)], &buffer[offset], size);
-            count += size;
-            offset = 0;
-            buffers.pop();
-        }
-        else
+        // Calculate weights for each input sample around the fractional position, normalized to sum to 1
+        double frac = (double)phase / PHASES;
+        double weights[MAX_TAPS], sum = 0;
+        for (uint32_t i = 0; i < taps; i++)
         {
-            // Copy as many queued samples that can fit to the output buffer
-            memcpy(&bufferOut[count / sizeof(uint32_t)], &buffer[offset], OUTPUT_SIZE - count);
-            offset += (OUTPUT_SIZE - count) / sizeof(uint32_t);
-            break;
+            double x = (double)i - (taps / 2 - 1) - frac;
+            if (!kernelType)
+            {
+                weights[i] = 1 - std::fabs(x);
+            }
+            else
+            {
+                double t = PI * x * cutoff;
+                double w = 0.42 + 0.5 * std::cos(PI * x / (taps / 2)) + 0.08 * std::cos(2 * PI * x / (taps / 2));
+                weights[i] = (t ? std::sin(t) / t : 1) * w;
+            }
+            sum += weights[i];
         }
+
+        // Duplicate each weight for the left and right channels
+        for (uint32_t i = 0; i < taps; i++)
+            kernel[phase][i * 2] = kernel[phase][i * 2 + 1] = weights[i] / sum;
     }
 
-    // Mark the buffer as ready and schedule the next one
-    ready.store(true);
-    Core::schedule(createBuffer, (uint64_t)SAMPLE_COUNT * (93750000 * 2) / OUTPUT_RATE);
+    // Start over with the window in range of the history
+    position = (uint64_t)(MAX_TAPS - taps / 2) << 32;
+}
+
+void AI::convertInput(uint32_t address, uint32_t count)
+{
+    // Get the part of the samples that's in RDRAM, reading anything past it as silence
+    float *out = &input[MAX_TAPS * 2];
+    uint32_t valid = (address < Memory::ramSize) ? std::min(count, (Memory::ramSize - address) / 4) : 0;
+    const uint8_t *src = &Memory::rdram[address];
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // Convert 4 stereo samples at once, swapping them from big-endian and sign-extending them to 32-bit
+    for (; i + 4 <= valid; i += 4)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+        data = _mm_or_si128(_mm_slli_epi16(data, 8), _mm_srli_epi16(data, 8));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(data, data), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(data, data), 16);
+        _mm_storeu_ps(&out[i * 2 + 0], _mm_cvtepi32_ps(low));
+        _mm_storeu_ps(&out[i * 2 + 4], _mm_cvtepi32_ps(high));
+    }
+#endif
+
+    // Convert any remaining samples one at a time
+    for (; i < valid; i++)
+    {
+        out[i * 2 + 0] = (int16_t)((src[i * 4 + 0] << 8) | src[i * 4 + 1]);
+        out[i * 2 + 1] = (int16_t)((src[i * 4 + 2] << 8) | src[i * 4 + 3]);
+    }
+    memset(&out[valid * 2], 0, (count - valid) * 2 * sizeof(float));
+}
+
+uint32_t AI::resample(const float *in, const float *coeffs)
+{
+    // Apply the filter to a window of input samples, and pack the result with the left channel in the low bits
+#ifdef __SSE2__
+    // Each vector holds 2 stereo samples, so both channels are filtered at once
+    __m128 sum = _mm_setzero_ps();
+    for (uint32_t i = 0; i < taps * 2; i += 4)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&in[i]), _mm_load_ps(&coeffs[i])));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    __m128i value = _mm_cvtps_epi32(sum);
+    return _mm_cvtsi128_si32(_mm_packs_epi32(value, value));
+#else
+    float left = 0, right = 0;
+    for (uint32_t i = 0; i < taps * 2; i += 2)
+    {
+        left += in[i] * coeffs[i];
+        right += in[i + 1] * coeffs[i + 1];
+    }
+    int32_t l = std::max(-0x8000L, std::min(0x7FFFL, std::lround(left)));
+    int32_t r = std::max(-0x8000L, std::min(0x7FFFL, std::lround(right)));
+    return ((uint16_t)r << 16) | (uint16_t)l;
+#endif
+}
+
+void AI::queueSamples(const uint32_t *values, uint32_t count)
+{
+    // Publish the samples to shared memory if enabled, even if they don't all fit in the ring
+    if (Shm::active())
+        Shm::publishAudio(values, count);
+
+    // Queue as many samples as fit in the ring, in two parts if they wrap around
+    // Samples that don't fit are dropped, like when the old buffer queue was full
+    uint32_t head = ringHead.load(std::memory_order_relaxed);
+    uint32_t size = std::min<uint32_t>(count, RING_SIZE - (head - ringTail.load(std::memory_order_acquire)));
+    uint32_t first = std::min<uint32_t>(size, RING_SIZE - (head % RING_SIZE));
+    memcpy(&ring[head % RING_SIZE], values, first * sizeof(uint32_t));
+    memcpy(ring, &values[first], (size - first) * sizeof(uint32_t));
+    ringHead.store(head + size, std::memory_order_release);
+}
+
+void AI::syncOutput()
+{
+    // Wait for the audio output to play enough of what's been queued, and schedule the next sync
+    Pacer::produce(SAMPLE_COUNT);
+    Core::schedule(syncOutput, (uint64_t)SAMPLE_COUNT * (93750000 * 2) / OUTPUT_RATE);
 }
 
 void AI::submitBuffer()
@@ -201,22 +315,35 @@ void AI::submitBuffer()
     LOG_INFO("Submitting %d AI samples from RDRAM 0x%X at frequency %dHz\n",
         samples[0].count, samples[0].address, frequency);
 
-    if (buffers.size() < MAX_BUFFERS)
+    if (frequency)
     {
-        // Create a new audio buffer based on sample count and frequency
-        size_t count = samples[0].count * OUTPUT_RATE / frequency;
-        std::vector<uint32_t> buffer(count);
-
-        // Copy samples to the buffer, scaled from their original frequency
-        for (size_t i = 0; i < count; i++)
+        // Rebuild the filter kernel if the input rate or the filter setting changed
+        if (kernelRate != frequency || kernelType != Settings::audioFilter)
+            buildKernel();
+
+        // Convert the new samples to follow the history from the previous DMA
+        uint32_t count = std::min<uint32_t>(samples[0].count, MAX_INPUT);
+        convertInput(samples[0].address, count);
+
+        // Resample until the filter window would run past the end of the input, adjusting the ratio to pace with output
+        // Samples are gathered in small chunks, so they can be queued and published together
+        uint64_t step = (uint64_t)(frequency * Pacer::rateScale() * 4294967296.0 / OUTPUT_RATE);
+        uint32_t chunk[CHUNK_SIZE], size = 0;
+        for (; (position >> 32) + taps / 2 < MAX_TAPS + count; position += step)
         {
-            uint32_t address = samples[0].address + (i * samples[0].count / count) * 4;
-            uint32_t value = Memory::read<uint32_t>(0xA0000000 + address);
-            buffer[i] = (value << 16) | (value >> 16);
+            const float *in = &input[((position >> 32) - (taps / 2 - 1)) * 2];
+            chunk[size++] = resample(in, kernel[(position >> 24) & (PHASES - 1)]);
+            if (size == CHUNK_SIZE)
+            {
+                queueSamples(chunk, size);
+                size = 0;
+            }
         }
+        queueSamples(chunk, size);
 
-        // Add the buffer to the output queue
-        buffers.push(buffer);
+        // Keep the last samples as history for the next DMA
+        position -= (uint64_t)count << 32;
+        memmove(input, &input[count * 2], MAX_TAPS * 2 * sizeof(float));
     }
 
     // Schedule the logical completion of the AI DMA based on sample count and frequency
@@ -29,6 +29,7 @@
 #include "cpu.h"
 #include "cpu_cp0.h"
 #include "cpu_cp1.h"
+#include "dump.h"
 #include "log.h"
 #include "memory.h"
 #include "mi.h"
@@ -38,6 +39,7 @@
 #include "rsp.h"
 #include "rsp_cp0.h"
 #include "rsp_cp2.h"
+#include "settings.h"
 #include "si.h"
 #include "vi.h"
 
@@ -154,6 +156,10 @@ bool Core::bootRom(const std::string &path)
     RSP_CP0::reset();
     RSP_CP2::reset();
 
+    // Start dumping frames if a path is set, so runs without a front-end menu can capture too
+    if (!Settings::dumpPath.empty() && !Dump::active())
+        Dump::start(Settings::dumpPath);
+
     // Start the emulator
     start();
     return true;
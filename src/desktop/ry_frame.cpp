@@ -22,7 +22,9 @@
 #include "input_dialog.h"
 #include "save_dialog.h"
 #include "../core.h"
+#include "../dump.h"
 #include "../pif.h"
+#include "../rdp.h"
 #include "../settings.h"
 
 enum FrameEvent
@@ -33,11 +35,19 @@ enum FrameEvent
     PAUSE,
     RESTART,
     STOP,
+    CAPTURE_RDP,
+    SAVE_RDP_STATS,
+    DUMP_FRAMES,
     INPUT_BINDINGS,
     FPS_LIMITER,
     EXPANSION_PAK,
     THREADED_RDP,
+    THREADED_VI,
     TEX_FILTER,
+    RDP_STATS,
+    FRAME_SKIP,
+    AUDIO_FILTER,
+    SHM_PUBLISH,
     UPDATE_JOY
 };
 
@@ -48,11 +58,19 @@ EVT_MENU(QUIT, ryFrame::quit)
 EVT_MENU(PAUSE, ryFrame::pause)
 EVT_MENU(RESTART, ryFrame::restart)
 EVT_MENU(STOP, ryFrame::stop)
+EVT_MENU(CAPTURE_RDP, ryFrame::captureRdp)
+EVT_MENU(SAVE_RDP_STATS, ryFrame::saveRdpStats)
+EVT_MENU(DUMP_FRAMES, ryFrame::toggleDump)
 EVT_MENU(INPUT_BINDINGS, ryFrame::inputSettings)
 EVT_MENU(FPS_LIMITER, ryFrame::toggleFpsLimit)
 EVT_MENU(EXPANSION_PAK, ryFrame::toggleExpanPak)
 EVT_MENU(THREADED_RDP, ryFrame::toggleThreadRdp)
+EVT_MENU(THREADED_VI, ryFrame::toggleThreadVi)
 EVT_MENU(TEX_FILTER, ryFrame::toggleTexFilter)
+EVT_MENU(RDP_STATS, ryFrame::toggleRdpStats)
+EVT_MENU(FRAME_SKIP, ryFrame::toggleFrameSkip)
+EVT_MENU(AUDIO_FILTER, ryFrame::toggleAudioFilter)
+EVT_MENU(SHM_PUBLISH, ryFrame::toggleShmPublish)
 EVT_TIMER(UPDATE_JOY, ryFrame::updateJoystick)
 EVT_DROP_FILES(ryFrame::dropFiles)
 EVT_CLOSE(ryFrame::close)
@@ -72,6 +90,10 @@ ryFrame::ryFrame(std::string path): wxFrame(nullptr, wxID_ANY, "rokuyon")
     systemMenu->Append(PAUSE, "&Resume");
     systemMenu->Append(RESTART, "&Restart");
     systemMenu->Append(STOP, "&Stop");
+    systemMenu->AppendSeparator();
+    systemMenu->Append(CAPTURE_RDP, "&Capture RDP Frame");
+    systemMenu->Append(SAVE_RDP_STATS, "Save RDP &Statistics");
+    systemMenu->AppendCheckItem(DUMP_FRAMES, "&Dump Frames");
     updateMenu();
 
     // Set up the settings menu
@@ -82,13 +104,23 @@ ryFrame::ryFrame(std::string path): wxFrame(nullptr, wxID_ANY, "rokuyon")
     settingsMenu->AppendCheckItem(EXPANSION_PAK, "&Expansion Pak");
     settingsMenu->AppendSeparator();
     settingsMenu->AppendCheckItem(THREADED_RDP, "&Threaded RDP");
+    settingsMenu->AppendCheckItem(THREADED_VI, "Threaded &VI");
     settingsMenu->AppendCheckItem(TEX_FILTER, "&Texture Filter");
+    settingsMenu->AppendCheckItem(RDP_STATS, "&RDP Statistics");
+    settingsMenu->AppendCheckItem(FRAME_SKIP, "Frame &Skip");
+    settingsMenu->AppendCheckItem(AUDIO_FILTER, "Sinc &Resampler");
+    settingsMenu->AppendCheckItem(SHM_PUBLISH, "Shared &Memory Output");
 
     // Set the initial checkbox states
     settingsMenu->Check(FPS_LIMITER, Settings::fpsLimiter);
     settingsMenu->Check(EXPANSION_PAK, Settings::expansionPak);
     settingsMenu->Check(THREADED_RDP, Settings::threadedRdp);
+    settingsMenu->Check(THREADED_VI, Settings::threadedVi);
     settingsMenu->Check(TEX_FILTER, Settings::texFilter);
+    settingsMenu->Check(RDP_STATS, Settings::rdpStats);
+    settingsMenu->Check(FRAME_SKIP, Settings::frameSkip);
+    settingsMenu->Check(AUDIO_FILTER, Settings::audioFilter);
+    settingsMenu->Check(SHM_PUBLISH, Settings::shmPublish);
 
     // Set up the menu bar
     wxMenuBar *menuBar = new wxMenuBar();
@@ -163,6 +195,9 @@ void ryFrame::updateMenu()
         systemMenu->Enable(PAUSE, true);
         systemMenu->Enable(RESTART, true);
         systemMenu->Enable(STOP, true);
+        systemMenu->Enable(CAPTURE_RDP, true);
+        systemMenu->Enable(SAVE_RDP_STATS, Settings::rdpStats);
+        systemMenu->Enable(DUMP_FRAMES, true);
         fileMenu->Enable(CHANGE_SAVE, true);
     }
     else
@@ -174,9 +209,15 @@ void ryFrame::updateMenu()
             systemMenu->Enable(PAUSE, false);
             systemMenu->Enable(RESTART, false);
             systemMenu->Enable(STOP, false);
+            systemMenu->Enable(CAPTURE_RDP, false);
+            systemMenu->Enable(SAVE_RDP_STATS, false);
+            systemMenu->Enable(DUMP_FRAMES, false);
             fileMenu->Enable(CHANGE_SAVE, false);
         }
     }
+
+    // Keep the dump checkbox in sync, since stopping emulation also stops the dump
+    systemMenu->Check(DUMP_FRAMES, Dump::active());
 }
 
 void ryFrame::Refresh()
@@ -187,6 +228,8 @@ void ryFrame::Refresh()
     wxString label = "rokuyon";
     if (Core::running)
         label += wxString::Format(" - %d FPS", Core::fps);
+    if (Core::running && Settings::rdpStats)
+        label += " - " + RDP::statsString();
     SetLabel(label);
 }
 
@@ -300,12 +343,35 @@ void ryFrame::restart(wxCommandEvent &event)
 
 void ryFrame::stop(wxCommandEvent &event)
 {
-    // Stop the emulator and reset the system menu
+    // Stop the emulator and any frame dump, and reset the system menu
     Core::stop();
+    Dump::stop();
     paused = false;
     updateMenu();
 }
 
+void ryFrame::captureRdp(wxCommandEvent &event)
+{
+    // Capture the next RDP frame to a file next to the ROM, for use with rdp-replay
+    RDP::startCapture(lastPath.substr(0, lastPath.rfind('.')), 1);
+}
+
+void ryFrame::saveRdpStats(wxCommandEvent &event)
+{
+    // Save the last frame's RDP statistics to a JSON file next to the ROM
+    RDP::dumpStats(lastPath.substr(0, lastPath.rfind('.')) + "_stats.json");
+}
+
+void ryFrame::toggleDump(wxCommandEvent &event)
+{
+    // Start or stop dumping frames to a Y4M file next to the ROM
+    if (Dump::active())
+        Dump::stop();
+    else
+        Dump::start(lastPath.substr(0, lastPath.rfind('.')) + ".y4m");
+    updateMenu();
+}
+
 void ryFrame::inputSettings(wxCommandEvent &event)
 {
     // Pause joystick updates and show the input settings dialog
@@ -336,6 +402,13 @@ void ryFrame::toggleThreadRdp(wxCommandEvent &event)
     Settings::save();
 }
 
+void ryFrame::toggleThreadVi(wxCommandEvent &event)
+{
+    // Toggle the threaded VI setting
+    Settings::threadedVi = !Settings::threadedVi;
+    Settings::save();
+}
+
 void ryFrame::toggleTexFilter(wxCommandEvent &event)
 {
     // Toggle the texture filter setting
@@ -343,6 +416,35 @@ void ryFrame::toggleTexFilter(wxCommandEvent &event)
     Settings::save();
 }
 
+void ryFrame::toggleRdpStats(wxCommandEvent &event)
+{
+    // Toggle the RDP statistics setting, and the menu item that depends on it
+    Settings::rdpStats = !Settings::rdpStats;
+    Settings::save();
+    updateMenu();
+}
+
+void ryFrame::toggleFrameSkip(wxCommandEvent &event)
+{
+    // Toggle the frameskip setting
+    Settings::frameSkip = !Settings::frameSkip;
+    Settings::save();
+}
+
+void ryFrame::toggleAudioFilter(wxCommandEvent &event)
+{
+    // Toggle the audio filter setting
+    Settings::audioFilter = !Settings::audioFilter;
+    Settings::save();
+}
+
+void ryFrame::toggleShmPublish(wxCommandEvent &event)
+{
+    // Toggle the shared memory output setting
+    Settings::shmPublish = !Settings::shmPublish;
+    Settings::save();
+}
+
 void ryFrame::updateJoystick(wxTimerEvent &event)
 {
     int stickX = 0;
@@ -462,8 +564,9 @@ void ryFrame::dropFiles(wxDropFilesEvent &event)
 
 void ryFrame::close(wxCloseEvent &event)
 {
-    // Stop emulation before exiting
+    // Stop emulation and finish any frame dump before exiting
     Core::stop();
+    Dump::stop();
     canvas->finish();
     event.Skip(true);
 }
@@ -61,11 +61,19 @@ class ryFrame: public wxFrame
         void pause(wxCommandEvent &event);
         void restart(wxCommandEvent &event);
         void stop(wxCommandEvent &event);
+        void captureRdp(wxCommandEvent &event);
+        void saveRdpStats(wxCommandEvent &event);
+        void toggleDump(wxCommandEvent &event);
         void inputSettings(wxCommandEvent &event);
         void toggleFpsLimit(wxCommandEvent &event);
         void toggleExpanPak(wxCommandEvent &event);
         void toggleThreadRdp(wxCommandEvent &event);
+        void toggleThreadVi(wxCommandEvent &event);
         void toggleTexFilter(wxCommandEvent &event);
+        void toggleRdpStats(wxCommandEvent &event);
+        void toggleFrameSkip(wxCommandEvent &event);
+        void toggleAudioFilter(wxCommandEvent &event);
+        void toggleShmPublish(wxCommandEvent &event);
         void updateJoystick(wxTimerEvent &event);
         void dropFiles(wxDropFilesEvent &event);
         void close(wxCloseEvent &event);
@@ -0,0 +1,254 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dump.h"
+#include "log.h"
+#include "pixel.h"
+#include "settings.h"
+#include "vi.h"
+
+#define DUMP_SLOTS 4
+#define SLOT_SIZE (MAX_FB_WIDTH * MAX_FB_HEIGHT * 4)
+
+struct DumpSlot
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t size;
+    bool repeat;
+    bool blank;
+};
+
+namespace Dump
+{
+    std::thread *writeThread;
+    std::condition_variable condVar;
+    std::mutex mutex;
+    std::atomic<bool> running(false);
+    bool filling;
+
+    // Frames are queued as raw pixels, and converted on the writer thread
+    std::vector<uint8_t> buffer;
+    DumpSlot slots[DUMP_SLOTS];
+    uint32_t head, tail, count;
+    uint32_t dropped;
+
+    FILE *file;
+    bool y4m;
+    uint32_t width, height;
+    std::vector<uint32_t> colors;
+    std::vector<uint8_t> output;
+
+    void convertFrame(DumpSlot *slot, uint8_t *data);
+    void writeFrames();
+}
+
+bool Dump::start(std::string path)
+{
+    // Open the output file, using Y4M if the extension asks for it and raw RGBA otherwise
+    stop();
+    if (!(file = fopen(path.c_str(), "wb")))
+    {
+        LOG_CRIT("Failed to open frame dump file: %s\n", path.c_str());
+        return false;
+    }
+
+    // Reset the ring and start the writer thread
+    y4m = (path.size() >= 4 && path.substr(path.size() - 4) == ".y4m");
+    buffer.resize(DUMP_SLOTS * SLOT_SIZE);
+    head = tail = count = 0;
+    dropped = 0;
+    width = height = 0;
+    filling = false;
+    running = true;
+    writeThread = new std::thread(writeFrames);
+
+    // Finish the dump on exit if nothing stops it first, like in a run without a front-end
+    static bool registered = false;
+    if (!registered) atexit(stop);
+    registered = true;
+    return true;
+}
+
+void Dump::stop()
+{
+    {
+        // Wait for the VI to finish a frame it's copying, and signal for the writer to stop
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!running) return;
+        condVar.wait(lock, [] { return !filling; });
+        running = false;
+        condVar.notify_all();
+    }
+
+    // Let the writer finish the queued frames, and close the file
+    writeThread->join();
+    delete writeThread;
+    fclose(file);
+    std::vector<uint8_t>().swap(buffer);
+    if (dropped)
+        LOG_WARN("Frame dump dropped %u frames\n", dropped);
+}
+
+bool Dump::active()
+{
+    // Check if frames are being dumped, without locking so the VI can check every frame
+    return running.load();
+}
+
+uint8_t *Dump::nextFrame(uint32_t width, uint32_t height, uint32_t size)
+{
+    // Drop the frame if the writer is behind, or wait for it if blocking is preferred
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count == DUMP_SLOTS && !Settings::dumpBlock)
+    {
+        dropped++;
+        return nullptr;
+    }
+    condVar.wait(lock, [] { return count < DUMP_SLOTS || !running; });
+    if (!running) return nullptr;
+
+    // Reserve the next slot for raw pixels, which are copied in without holding the lock
+    slots[head] = { width, height, size, false, false };
+    filling = true;
+    return &buffer[head * SLOT_SIZE];
+}
+
+void Dump::submitFrame()
+{
+    // Queue the filled slot for the writer
+    std::lock_guard<std::mutex> guard(mutex);
+    filling = false;
+    head = (head + 1) % DUMP_SLOTS;
+    count++;
+    condVar.notify_all();
+}
+
+void Dump::repeatFrame()
+{
+    // Queue a copy of the last frame, so the dump keeps its timing when the VI shows the same thing
+    if (nextFrame(0, 0, 0))
+    {
+        slots[head].repeat = true;
+        submitFrame();
+    }
+}
+
+void Dump::blankFrame()
+{
+    // Queue a black frame for when the VI isn't showing anything, which doesn't need any pixels
+    if (nextFrame(0, 0, 0))
+    {
+        slots[head].blank = true;
+        submitFrame();
+    }
+}
+
+void Dump::convertFrame(DumpSlot *slot, uint8_t *data)
+{
+    // Set the stream size from the first frame, since Y4M and raw streams can't change it
+    if (!width)
+    {
+        width = std::max(slot->width, 1U);
+        height = std::max(slot->height, 1U);
+        colors.assign(width * height, 0xFF000000);
+        output.resize(width * height * (y4m ? 3 : 4));
+        if (y4m)
+            fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C444\n", width, height);
+    }
+
+    // Convert the rows that fit in the stream to screen colors, cropping or padding with black
+    uint32_t w = std::min(slot->width, width);
+    uint32_t h = std::min(slot->height, height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint32_t *row = &colors[y * width];
+        uint32_t x = 0;
+        if (y < h)
+        {
+            uint8_t *src = &data[y * slot->width * slot->size];
+            x = w;
+            if (slot->size == 4)
+                Pixel::rgba32ToScreen(src, row, w);
+            else
+                Pixel::rgba16ToScreen(src, row, w);
+        }
+        for (; x < width; x++)
+            row[x] = 0xFF000000;
+    }
+
+    if (!y4m)
+    {
+        // Screen colors are already RGBA bytes in memory
+        memcpy(output.data(), colors.data(), output.size());
+        return;
+    }
+
+    // Convert to planar BT.601 YUV with studio swing
+    uint32_t pixels = width * height;
+    for (uint32_t i = 0; i < pixels; i++)
+    {
+        int r = (colors[i] >> 0) & 0xFF;
+        int g = (colors[i] >> 8) & 0xFF;
+        int b = (colors[i] >> 16) & 0xFF;
+        output[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        output[pixels + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        output[pixels * 2 + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+void Dump::writeFrames()
+{
+    while (true)
+    {
+        // Wait for a queued frame, and exit once stopped with nothing left to write
+        std::unique_lock<std::mutex> lock(mutex);
+        condVar.wait(lock, [] { return count || !running; });
+        if (!count) return;
+        DumpSlot slot = slots[tail];
+        uint8_t *data = &buffer[tail * SLOT_SIZE];
+        lock.unlock();
+
+        // Convert the frame unless it's a repeat, and write it out
+        // Repeats and blank frames before the first real frame are skipped, so the stream takes its size from that
+        if (!slot.repeat && !(slot.blank && !width))
+            convertFrame(&slot, data);
+        if (width)
+        {
+            if (y4m) fputs("FRAME\n", file);
+            fwrite(output.data(), sizeof(uint8_t), output.size(), file);
+        }
+
+        // Free the slot for the VI
+        lock.lock();
+        tail = (tail + 1) % DUMP_SLOTS;
+        count--;
+        condVar.notify_all();
+    }
+}
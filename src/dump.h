@@ -0,0 +1,40 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <cstdint>
+#include <string>
+
+// Dumping of VI frames to a Y4M or raw RGBA stream, written to disk on a separate thread
+// Frames are queued in a small ring, which either drops frames or blocks the VI when full
+namespace Dump
+{
+    bool start(std::string path);
+    void stop();
+    bool active();
+
+    uint8_t *nextFrame(uint32_t width, uint32_t height, uint32_t size);
+    void submitFrame();
+    void repeatFrame();
+    void blankFrame();
+}
+
+#endif // DUMP_H
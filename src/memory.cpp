@@ -18,6 +18,7 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 
 #include "memory.h"
@@ -58,6 +59,9 @@ namespace Memory
     uint8_t rspMem[0x2000];  // 4KB RSP DMEM + 4KB RSP IMEM
     TLBEntry entries[32];
     uint32_t ramSize;
+    std::atomic<uint32_t> cpuWrites[0x800]; // Write counts for each 4KB page of RDRAM, bumped only by the CPU thread
+    std::atomic<uint32_t> rdpWrites[0x800]; // Write counts for each 4KB page of RDRAM, bumped only by the RDP
+    std::atomic<uint32_t> watches; // Times write counts were checked, so skipped marks can be redone
 
     uint8_t writeBuf[0x80];
     uint64_t status;
@@ -74,6 +78,12 @@ void Memory::reset()
     memset(rdram, 0, sizeof(rdram));
     memset(rspMem, 0, sizeof(rspMem));
     memset(writeBuf, 0, sizeof(writeBuf));
+    for (int i = 0; i < 0x800; i++)
+    {
+        cpuWrites[i].store(0, std::memory_order_relaxed);
+        rdpWrites[i].store(0, std::memory_order_relaxed);
+    }
+    watches.store(0, std::memory_order_relaxed);
     ramSize = Settings::expansionPak ? 0x800000 : 0x400000;
     writeOfs = 0;
     eraseOfs = 0;
@@ -84,6 +94,37 @@ void Memory::reset()
         entries[i].entryHi = 0x80000000;
 }
 
+void Memory::markWritten(uint32_t address, uint32_t size)
+{
+    // Count a write to each RDRAM page in a range, for writes that bypass the memory handlers
+    // Only the RDP marks pages this way, so the counts don't need an atomic read-modify-write
+    uint32_t end = std::min(address + size, ramSize);
+    for (uint32_t page = address >> 12; page < ((end + 0xFFF) >> 12); page++)
+        rdpWrites[page].store(rdpWrites[page].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+uint32_t Memory::countWrites(uint32_t address, uint32_t size)
+{
+    // Sum the write counts of the RDRAM pages in a range, which only stays the same if nothing wrote to them
+    uint32_t count = 0;
+    uint32_t end = std::min(address + size, ramSize);
+    for (uint32_t page = address >> 12; page < ((end + 0xFFF) >> 12); page++)
+        count += cpuWrites[page].load(std::memory_order_relaxed) + rdpWrites[page].load(std::memory_order_relaxed);
+    return count;
+}
+
+void Memory::watchWrites()
+{
+    // Note that write counts are being compared, so writers that skip repeated marks will mark again
+    watches.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint32_t Memory::watchCount()
+{
+    // Get the number of times write counts were compared, to tell if marks made since are still needed
+    return watches.load(std::memory_order_relaxed);
+}
+
 void Memory::getEntry(uint32_t index, uint32_t &entryLo0, uint32_t &entryLo1, uint32_t &entryHi, uint32_t &pageMask)
 {
     // Get the TLB entry at the given index
@@ -149,6 +190,14 @@ lookup:
     // Look up the physical address
     if (pAddr < ramSize)
     {
+        // Wait for the RDP thread if it might still be drawing to this address
+        if (RDP::busy)
+            RDP::waitAddress(pAddr);
+
+        // Let the RDP know if the CPU reads a display buffer that frameskip might leave stale
+        if (RDP::skipped)
+            RDP::readDisplay(pAddr);
+
         // Get a pointer to data in RDRAM
         // TODO: figure out RDRAM registers and how they affect mapping
         data = &rdram[pAddr];
@@ -295,6 +344,15 @@ lookup:
     // Look up the physical address
     if (pAddr < ramSize)
     {
+        // Wait for the RDP thread if it might still be drawing to this address
+        if (RDP::busy)
+            RDP::waitAddress(pAddr);
+
+        // Count the write so cached data derived from this page can be checked for changes
+        // Only this thread bumps these counts, so a plain load and store is enough
+        std::atomic<uint32_t> &count = cpuWrites[pAddr >> 12];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
         // Get a pointer to data in RDRAM
         // TODO: figure out RDRAM registers and how they affect mapping
         data = &rdram[pAddr];
@@ -24,7 +24,14 @@
 
 namespace Memory
 {
+    extern uint8_t rdram[0x800000];
+    extern uint32_t ramSize;
+
     void reset();
+    void markWritten(uint32_t address, uint32_t size);
+    uint32_t countWrites(uint32_t address, uint32_t size);
+    void watchWrites();
+    uint32_t watchCount();
     void getEntry(uint32_t index, uint32_t &entryLo0, uint32_t &entryLo1, uint32_t &entryHi, uint32_t &pageMask);
     void setEntry(uint32_t index, uint32_t  entryLo0, uint32_t  entryLo1, uint32_t  entryHi, uint32_t  pageMask);
 
@@ -0,0 +1,106 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include "pacer.h"
+#include "core.h"
+#include "settings.h"
+
+#define LATENCY 2048
+#define TARGET_LEVEL 2048
+#define MAX_ADJUST 0.005
+
+namespace Pacer
+{
+    std::condition_variable condVar;
+    std::mutex mutex;
+
+    // Samples of emulated time that have passed, and samples that the audio thread has played
+    int64_t produced;
+    int64_t consumed;
+    uint32_t sampleRate;
+
+    // The steady clock time the emulator should reach, for when there's no audio thread to pace against
+    std::chrono::steady_clock::time_point deadline;
+
+    // A smoothed level of queued samples, used to nudge the resampling ratio
+    double level;
+    double scale;
+}
+
+void Pacer::reset(uint32_t rate)
+{
+    // Start with nothing ahead and no rate adjustment
+    std::lock_guard<std::mutex> guard(mutex);
+    produced = consumed = 0;
+    sampleRate = rate;
+    deadline = std::chrono::steady_clock::now();
+    level = TARGET_LEVEL;
+    scale = 1.0;
+}
+
+void Pacer::produce(uint32_t count)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    produced += count;
+    condVar.notify_all();
+
+    // Advance the clock deadline, keeping it close to the current time so it never causes a burst or a stall
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::microseconds period((uint64_t)count * 1000000 / sampleRate);
+    std::chrono::microseconds latency((uint64_t)LATENCY * 1000000 / sampleRate);
+    deadline = std::min(std::max(deadline + period, now - latency), now + latency);
+    if (!Settings::fpsLimiter) return;
+
+    // Sleep until the audio thread has played enough to be within the latency of the emulator
+    // If it doesn't get there by the deadline, like with no audio device, pace by the clock and resync the counts
+    if (!condVar.wait_until(lock, deadline + latency, [&] { return produced - consumed <= LATENCY || !Core::running; }))
+        consumed = produced - LATENCY;
+}
+
+void Pacer::waitConsume(uint32_t count, std::chrono::microseconds timeout)
+{
+    // Give the emulator a little time to produce samples if it's behind, sleeping while waiting
+    std::unique_lock<std::mutex> lock(mutex);
+    condVar.wait_for(lock, timeout, [&] { return produced - consumed >= count; });
+}
+
+void Pacer::consume(uint32_t count, uint32_t queued)
+{
+    // Count the played samples and wake the emulator if it's waiting
+    // Playback past what's been produced isn't counted, so the emulator doesn't rush after falling behind
+    std::lock_guard<std::mutex> guard(mutex);
+    consumed = std::min(consumed + count, produced);
+    condVar.notify_all();
+
+    // Adjust the resampling ratio slightly based on the queued level, so the queue doesn't drift into underruns
+    // With more queued than the target the resampler outputs slightly fewer samples, and with less it outputs more
+    level += (queued - level) * 0.05;
+    scale = 1.0 + std::max(-1.0, std::min(1.0, (level - TARGET_LEVEL) / TARGET_LEVEL)) * MAX_ADJUST;
+}
+
+double Pacer::rateScale()
+{
+    // Get the current resampling ratio adjustment
+    std::lock_guard<std::mutex> guard(mutex);
+    return scale;
+}
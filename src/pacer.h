@@ -0,0 +1,37 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACER_H
+#define PACER_H
+
+#include <chrono>
+#include <cstdint>
+
+// Paces emulation against audio output, sleeping instead of spinning on either side
+// Both sides count samples, so the emulator can run a little ahead of what the audio thread has played
+namespace Pacer
+{
+    void reset(uint32_t rate);
+    void produce(uint32_t count);
+    void waitConsume(uint32_t count, std::chrono::microseconds timeout);
+    void consume(uint32_t count, uint32_t queued);
+    double rateScale();
+}
+
+#endif // PACER_H
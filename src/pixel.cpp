@@ -0,0 +1,108 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixel.h"
+
+namespace Pixel
+{
+    uint32_t rgba16Table[0x10000];
+    uint32_t screen16Table[0x10000];
+    bool initialized = false;
+}
+
+void Pixel::init()
+{
+    // Build the lookup tables once, since they never change
+    if (initialized) return;
+    initialized = true;
+
+    for (uint32_t color = 0; color < 0x10000; color++)
+    {
+        // Convert RGBA16 to RGBA32 the way the RDP does, repeating the top bits of each component
+        uint8_t r = ((color >> 8) & 0xF8) | ((color >> 13) & 0x7);
+        uint8_t g = ((color >> 3) & 0xF8) | ((color >>  8) & 0x7);
+        uint8_t b = ((color << 2) & 0xF8) | ((color >>  3) & 0x7);
+        uint8_t a = (color & 0x1) ? 0xFF : 0x00;
+        rgba16Table[color] = (r << 24) | (g << 16) | (b << 8) | a;
+
+        // Convert RGBA16 to an opaque screen color the way the VI does, scaling each component
+        r = ((color >> 11) & 0x1F) * 255 / 31;
+        g = ((color >>  6) & 0x1F) * 255 / 31;
+        b = ((color >>  1) & 0x1F) * 255 / 31;
+        screen16Table[color] = (0xFF << 24) | (b << 16) | (g << 8) | r;
+    }
+}
+
+void Pixel::rgba16ToScreen(const uint8_t *src, uint32_t *dst, uint32_t count)
+{
+    // Convert a row of big-endian RGBA16 pixels to opaque screen colors
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // Convert 8 pixels at once, scaling components with (value * 1053) >> 7, which equals value * 255 / 31 for 5 bits
+    __m128i mask = _mm_set1_epi16(0x1F);
+    __m128i scale = _mm_set1_epi16(1053);
+    __m128i alpha = _mm_set1_epi16((int16_t)0xFF00);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i colors = _mm_loadu_si128((const __m128i*)&src[i * 2]);
+        colors = _mm_or_si128(_mm_slli_epi16(colors, 8), _mm_srli_epi16(colors, 8));
+        __m128i r = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(colors, 11), mask), scale), 7);
+        __m128i g = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(colors,  6), mask), scale), 7);
+        __m128i b = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(colors,  1), mask), scale), 7);
+
+        // Interleave red/green and blue/alpha halves into 32-bit screen colors
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        __m128i ba = _mm_or_si128(b, alpha);
+        _mm_storeu_si128((__m128i*)&dst[i + 0], _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*)&dst[i + 4], _mm_unpackhi_epi16(rg, ba));
+    }
+#endif
+
+    // Convert any remaining pixels with the lookup table
+    for (; i < count; i++)
+        dst[i] = screen16Table[(src[i * 2] << 8) | src[i * 2 + 1]];
+}
+
+void Pixel::rgba32ToScreen(const uint8_t *src, uint32_t *dst, uint32_t count)
+{
+    // Convert a row of big-endian RGBA32 pixels to opaque screen colors
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // Bytes are already in screen order when loaded little-endian, so only alpha needs to be set
+    __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i colors = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(colors, alpha));
+    }
+#endif
+
+    // Convert any remaining pixels one at a time
+    for (; i < count; i++)
+    {
+        const uint8_t *color = &src[i * 4];
+        dst[i] = (0xFF << 24) | (color[2] << 16) | (color[1] << 8) | color[0];
+    }
+}
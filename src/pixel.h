@@ -0,0 +1,76 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <cstdint>
+
+// Conversions between N64 pixel formats, shared by the RDP and VI
+// RGBA32 colors are packed as (R << 24) | (G << 16) | (B << 8) | A, and screen colors as (A << 24) | (B << 16) | (G << 8) | R
+namespace Pixel
+{
+    extern uint32_t rgba16Table[0x10000];
+    extern uint32_t screen16Table[0x10000];
+
+    void init();
+    void rgba16ToScreen(const uint8_t *src, uint32_t *dst, uint32_t count);
+    void rgba32ToScreen(const uint8_t *src, uint32_t *dst, uint32_t count);
+
+    inline uint32_t rgba16To32(uint16_t color)
+    {
+        // Look up an RGBA16 color converted to RGBA32, with the top bits of each component repeated
+        return rgba16Table[color];
+    }
+
+    inline uint16_t rgba32To16(uint32_t color)
+    {
+        // Convert an RGBA32 color to RGBA16, keeping the top bits of each component
+        uint8_t r = ((color >> 27) & 0x1F);
+        uint8_t g = ((color >> 19) & 0x1F);
+        uint8_t b = ((color >> 11) & 0x1F);
+        uint8_t a = (color & 0xFF) ? 0x1 : 0x0;
+        return (r << 11) | (g << 6) | (b << 1) | a;
+    }
+
+    inline uint32_t ia4To32(uint8_t value)
+    {
+        // Convert a 3-bit intensity and 1-bit alpha to RGBA32
+        uint8_t i = ((value << 4) & 0xE0) | ((value << 1) & 0x1C) | ((value >> 2) & 0x3);
+        uint8_t a = (value & 0x1) ? 0xFF : 0x0;
+        return (i << 24) | (i << 16) | (i << 8) | a;
+    }
+
+    inline uint32_t ia8To32(uint8_t value)
+    {
+        // Convert a 4-bit intensity and 4-bit alpha to RGBA32
+        uint8_t i = (value & 0xF0) | (value >> 4);
+        uint8_t a = (value & 0x0F) | (value << 4);
+        return (i << 24) | (i << 16) | (i << 8) | a;
+    }
+
+    inline uint32_t i4To32(uint8_t value)
+    {
+        // Convert a 4-bit intensity to RGBA32, using it for alpha too
+        uint8_t i = (value << 4) | (value & 0xF);
+        return (i << 24) | (i << 16) | (i << 8) | i;
+    }
+}
+
+#endif // PIXEL_H
@@ -18,15 +18,26 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
 #include <mutex>
+#include <queue>
 #include <thread>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "rdp.h"
+#include "core.h"
 #include "log.h"
 #include "memory.h"
 #include "mi.h"
+#include "pixel.h"
 #include "settings.h"
 
 enum Format
@@ -43,6 +54,27 @@ enum CycleType
     ONE_CYCLE, TWO_CYCLE, COPY_MODE, FILL_MODE
 };
 
+enum CaptureRecord
+{
+    CAPTURE_COMMAND, CAPTURE_MEMORY, CAPTURE_BUFFER, CAPTURE_TMEM, CAPTURE_STATE, CAPTURE_END
+};
+
+// Combiner equations with simplified formulas, classified per cycle from the combine mode
+enum CombineKind
+{
+    COMBINE_GENERIC, // (A - B) * C + D
+    COMBINE_MULTIPLY, // A * C, with B and D set to 0
+    COMBINE_D // D, with C set to 0 or A and B cancelling out
+};
+
+// Blender configurations with specialized pixel functions, packed as (A << 6) | (B << 4) | (C << 2) | D
+enum BlendMode
+{
+    BLEND_GENERIC = -1,
+    BLEND_OPAQUE = 0x32, // Combined color * 0 + combined color * 1
+    BLEND_ALPHA = 0x04 // Combined color * alpha + memory color * (1 - alpha)
+};
+
 struct Tile
 {
     uint16_t sBase;
@@ -59,18 +91,188 @@ struct Tile
     uint16_t width;
     uint8_t palette;
     Format format;
+    uint64_t command;
+
+    uint32_t (*sampler)(Tile &tile, int s, int t, bool rect);
+    uint32_t *texels;
+    bool cached;
+    uint16_t sWrap;
+    uint16_t tWrap;
+    uint8_t shift;
+};
+
+struct Span
+{
+    uint8_t *colorLine;
+    uint8_t *zLine;
+    Tile *tile;
+    int x;
+    int y;
+    int inc;
+    int count;
+
+    int32_t r, g, b, a;
+    int32_t s, t, w, z;
+    int32_t drdx, dgdx, dbdx, dadx;
+    int32_t dsdx, dtdx, dwdx, dzdx;
+};
+
+struct TriangleCommand
+{
+    int32_t y1, y2, y3;
+    int32_t x1, x2, x3;
+    int32_t slope1, slope2, slope3;
+    bool orient;
+    uint8_t tile;
+
+    int32_t r, g, b, a;
+    int32_t s, t, w, z;
+    int32_t drdx, dgdx, dbdx, dadx; // Already in the direction lines are drawn
+    int32_t dsdx, dtdx, dwdx, dzdx;
+    int32_t drde, dgde, dbde, dade;
+    int32_t dsde, dtde, dwde, dzde;
+};
+
+struct RectCommand
+{
+    uint16_t x1, y1;
+    uint16_t x2, y2;
+    uint8_t tile;
+    int32_t s, t;
+    int16_t dsdx, dtdy;
+};
+
+union Primitive
+{
+    TriangleCommand triangle;
+    RectCommand rect;
+};
+
+struct CaptureRange
+{
+    uint32_t address;
+    uint32_t size;
+    uint32_t writes;
+};
+
+struct ZBlock
+{
+    uint16_t min;
+    uint16_t max;
+    uint32_t generation;
+};
+
+struct Upload
+{
+    uint64_t command;
+    uint32_t texAddress;
+    uint16_t texWidth;
+    Format texFormat;
+    uint16_t tileAddress;
+    uint16_t tileWidth;
+    Format tileFormat;
+
+    uint64_t hash;
+    uint32_t writes;
+    uint64_t blocks;
+    uint32_t id;
+};
+
+struct DisplayBuffer
+{
+    uint32_t address;
+    uint32_t size;
+    bool readBack;
+    bool stale;
+};
+
+struct Combiner
+{
+    uint64_t mode;
+    uint32_t *inputs[4][4];
+    CombineKind kinds[2];
+};
+
+struct Batch
+{
+    int x[4];
+    uint32_t shade[4];
+    uint32_t texel[4];
+    uint16_t z[4];
+    int count;
 };
 
 namespace RDP
 {
     extern void (*commands[])();
     extern uint8_t paramCounts[];
+    extern bool (*pixelFuncs[][2][3][3])(int, uint8_t*);
+    extern void (*spanFuncs[])(Span&);
 
     std::thread *thread;
     std::mutex mutex;
+    std::condition_variable condVar;
+    std::condition_variable doneCond;
     bool running;
+    bool busy;
+    bool skipped;
+
+    std::atomic<uint32_t> executed;
+    uint32_t queued;
+    uint32_t syncWords;
+    std::queue<uint32_t> syncs;
+    std::queue<Primitive> primitives;
+
+    uint32_t colorStart;
+    uint32_t colorEnd;
+    uint32_t zStart;
+    uint32_t zEnd;
+    std::mutex captureMutex;
+    std::atomic<int> captureRequest;
+    std::string capturePath;
+    int captureIndex;
+    bool capturing;
+    std::vector<uint8_t> capture;
+    size_t captureStart;
+    std::vector<CaptureRange> captureRanges;
+    std::vector<CaptureRange> captureBuffers;
+    uint64_t pixelCount;
+
+    std::mutex statsMutex;
+    Stats stats;
+    Stats frameStats;
+    uint64_t drawnCount;
+    uint64_t rejectCount;
+    uint64_t texelCount;
+    uint64_t tmemCount;
+    uint64_t skipCount;
+
+    uint32_t trackColorAddr;
+    uint16_t trackColorWidth;
+    uint8_t trackColorSize;
+    uint32_t trackZAddr;
+    uint16_t trackScissorX;
+    uint16_t trackScissorY;
+
+    DisplayBuffer displays[4];
+    uint32_t displayCount;
+    DisplayBuffer *drawDisplay;
+    uint32_t skipColorAddr;
+    bool skipZUpdate;
+    bool skipping;
+    int skipRatio;
+    uint32_t skipFrames;
+    uint32_t governorFrames;
+    int governorFast;
+    std::chrono::steady_clock::time_point governorTime;
+
+    uint64_t stateWords[0x40];
+    uint64_t tileWords[8];
+    uint64_t tileSizeWords[8];
+    bool stateFilter;
 
     uint8_t tmem[0x1000]; // 4KB TMEM
+    uint32_t texCache[8][0x4000]; // Decoded texels for each tile
     uint32_t startAddr;
     uint32_t endAddr;
     uint32_t status;
@@ -78,8 +280,12 @@ namespace RDP
     uint32_t addrBase;
     uint32_t addrMask;
     uint8_t paramCount;
-    std::vector<uint64_t> opcode;
+    std::vector<uint64_t> params;
+    uint64_t *opcode;
+    Primitive *primitive;
 
+    uint64_t otherModes;
+    uint64_t combineMode;
     CycleType cycleType;
     bool texFilter;
     uint8_t blendA[2];
@@ -128,28 +334,110 @@ namespace RDP
     uint32_t *combineB[4];
     uint32_t *combineC[4];
     uint32_t *combineD[4];
+    CombineKind combineKinds[2];
+    Combiner combiners[32];
+    uint32_t combinerCount;
+    bool (*pixelFunc)(int x, uint8_t *line);
+    int (*batchFunc)(Batch &batch, uint8_t *line);
+    uint64_t blendRecips[0x200];
+    uint32_t perspRecips[0x10001];
+    uint32_t filterWeights[0x400];
+
+    uint8_t *colorBuffer;
+    uint8_t *zBuffer;
+    uint32_t colorPitch;
+    uint32_t zPitch;
+    int colorLines;
+    int zLines;
+
+    ZBlock zBlocks[0x4000];
+    uint32_t zGeneration;
+    uint32_t zBlockOffset;
+    uint32_t zBlockSize;
+    uint32_t zBlockPitch;
+    uint32_t zBlockWrites;
+    bool coarseDepth;
+
+    uint32_t markColorOffset;
+    uint32_t markColorSize;
+    uint32_t markZOffset;
+    uint32_t markZSize;
+    uint32_t colorWatch;
+    uint32_t zWatch;
+
+    Upload uploads[16];
+    uint32_t uploadCount;
+    uint32_t blockOwners[64];
+    uint8_t loadBuffer[0x4010];
+
+    template <typename T> T readBuffer(uint8_t *data);
+    template <typename T> void writeBuffer(uint8_t *data, T value);
+    template <typename T> T readRdram(uint32_t address);
+    template <typename T> void writeRdram(uint32_t address, T value);
+    void resolveBuffers();
+    void buildBlock(ZBlock &block, int x, int y);
+    int testBlock(int x, int y, int count, int32_t z, int32_t dzdx);
+    void dirtyBlocks(Span &span);
+    uint64_t tmemBlocks(uint32_t address, uint32_t size);
+    bool skipUpload(uint32_t address, uint32_t size, int rows, uint64_t blocks);
+    const uint8_t *textureData(uint32_t address, uint32_t size);
+    void copyTmem(uint32_t address, const uint8_t *src, uint32_t size, bool swap);
+    void splitTexels(const uint8_t *src, uint8_t *high, uint8_t *low, uint32_t count);
 
-    uint32_t RGBA16toRGBA32(uint16_t color);
-    uint16_t RGBA32toRGBA16(uint32_t color);
     uint32_t colorToAlpha(uint32_t color);
 
-    uint32_t getTexel(Tile &tile, int s, int t, bool rect = false);
-    uint32_t getRawTexel(Tile &tile, int s, int t);
-    bool blendPixel(bool cycle, uint32_t &color);
-    bool drawPixel(int x, int y);
-    bool testDepth(int x, int y, int z);
-
+    template <int format, bool filter, bool cached> uint32_t getTexel(Tile &tile, int s, int t, bool rect);
+    template <int format, bool filter> uint32_t buildTexels(Tile &tile, int s, int t, bool rect);
+    template <int format, bool cached> uint32_t fetchTexel(Tile &tile, int s, int t);
+    template <int format> uint32_t getRawTexel(Tile &tile, int s, int t);
+    int32_t perspDivide(int32_t value, int32_t divisor);
+    template <int cycle> uint32_t combinePixel();
+    template <int mode> bool blendPixel(bool cycle, uint32_t &color);
+    template <CycleType type, bool rgba16, int mode0, int mode1> bool drawPixel(int x, uint8_t *line);
+    template <bool shade, bool texture, bool depth, bool compare, bool update> void drawSpan(Span &span);
+    template <bool update> int flushBatch(Batch &batch, Span &span);
+
+#ifdef __SSE2__
+    __m128i div255(__m128i value);
+    __m128i alphaLanes(__m128i colors);
+    __m128i inputLanes(uint32_t *input, __m128i texel, __m128i shade);
+    __m128i combineLanes(__m128i a, __m128i b, __m128i c, __m128i d);
+    template <bool rgba16, int mode> int drawBatch(Batch &batch, uint8_t *line);
+#endif
+    template <bool compare, bool update> void setDepthSpans();
+    bool testDepth(int x, uint8_t *line, int z);
+    bool batchable();
+    template <int format> void setSampler(Tile &tile, bool filter, bool cached);
+    void updateSampler(Tile &tile);
+    void invalidateTexels();
+    void updatePipeline();
+
+    void captureData(const void *data, uint32_t size);
+    void captureMemory(CaptureRecord type, uint32_t address, uint32_t size);
+    uint64_t hashBuffers(std::vector<CaptureRange> &buffers);
+    void beginCapture();
+    void endCapture();
+    void captureCommand(uint8_t op);
+
+    void waitIdle();
+    void syncInterrupt();
+    void trackCommand(uint8_t op);
+    bool redundantState(uint64_t value);
+    DisplayBuffer *findDisplay(uint32_t address);
+    void updateSkipped();
+    bool skipCommand(uint8_t op, uint64_t value);
+    bool isPrimitive(uint8_t op);
+    void decodeTriangle(const uint64_t *words, TriangleCommand &tri);
+    void decodeRect(const uint64_t *words, RectCommand &rect);
+    void decodeCommand(uint8_t op, const uint64_t *words, Primitive &prim);
+    void executeCommand(uint8_t op, bool run);
     void runThreaded();
     void runCommands();
 
-    void triangle();
-    void triDepth();
-    void triTexture();
-    void triDepthTex();
-    void triShade();
-    void triDepthSha();
-    void triShadeTex();
-    void triDepShaTex();
+    int32_t advance(int32_t value, int32_t step, uint32_t count);
+    bool clipSpan(Span &span);
+    template <bool shade, bool texture, bool depth> void triangle();
+    void copyRectangle(Tile &tile, int x1, int x2, int y1, int y2, int s, int t, int dtdy);
     void texRectangle();
     void syncFull();
     void setScissor();
@@ -177,8 +465,10 @@ void (*RDP::commands[0x40])() =
 {
     unknown,      unknown,       unknown,       unknown,       // 0x00-0x03
     unknown,      unknown,       unknown,       unknown,       // 0x04-0x07
-    triangle,     triDepth,      triTexture,    triDepthTex,   // 0x08-0x0B
-    triShade,     triDepthSha,   triShadeTex,   triDepShaTex,  // 0x0C-0x0F
+    triangle<false, false, false>, triangle<false, false, true>, // 0x08-0x09
+    triangle<false, true,  false>, triangle<false, true,  true>, // 0x0A-0x0B
+    triangle<true,  false, false>, triangle<true,  false, true>, // 0x0C-0x0D
+    triangle<true,  true,  false>, triangle<true,  true,  true>, // 0x0E-0x0F
     unknown,      unknown,       unknown,       unknown,       // 0x10-0x13
     unknown,      unknown,       unknown,       unknown,       // 0x14-0x17
     unknown,      unknown,       unknown,       unknown,       // 0x18-0x1B
@@ -205,6 +495,98 @@ uint8_t RDP::paramCounts[0x40] =
     1, 1,  1,  1,  1,  1,  1,  1  // 0x38-0x3F
 };
 
+// Pixel functions for one-cycle and two-cycle modes, indexed by cycle type, RGBA16 format, and blender modes
+// Blender modes are indexed as generic, opaque, and alpha; only two-cycle mode uses the second cycle's mode
+bool (*RDP::pixelFuncs[2][2][3][3])(int, uint8_t*) =
+{
+    {
+        {
+            {
+                drawPixel<ONE_CYCLE, false, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_GENERIC, BLEND_GENERIC>
+            },
+            {
+                drawPixel<ONE_CYCLE, false, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_OPAQUE, BLEND_GENERIC>
+            },
+            {
+                drawPixel<ONE_CYCLE, false, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, false, BLEND_ALPHA, BLEND_GENERIC>
+            }
+        },
+        {
+            {
+                drawPixel<ONE_CYCLE, true, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_GENERIC, BLEND_GENERIC>
+            },
+            {
+                drawPixel<ONE_CYCLE, true, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_OPAQUE, BLEND_GENERIC>
+            },
+            {
+                drawPixel<ONE_CYCLE, true, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<ONE_CYCLE, true, BLEND_ALPHA, BLEND_GENERIC>
+            }
+        }
+    },
+    {
+        {
+            {
+                drawPixel<TWO_CYCLE, false, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, false, BLEND_GENERIC, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, false, BLEND_GENERIC, BLEND_ALPHA>
+            },
+            {
+                drawPixel<TWO_CYCLE, false, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, false, BLEND_OPAQUE, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, false, BLEND_OPAQUE, BLEND_ALPHA>
+            },
+            {
+                drawPixel<TWO_CYCLE, false, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, false, BLEND_ALPHA, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, false, BLEND_ALPHA, BLEND_ALPHA>
+            }
+        },
+        {
+            {
+                drawPixel<TWO_CYCLE, true, BLEND_GENERIC, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, true, BLEND_GENERIC, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, true, BLEND_GENERIC, BLEND_ALPHA>
+            },
+            {
+                drawPixel<TWO_CYCLE, true, BLEND_OPAQUE, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, true, BLEND_OPAQUE, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, true, BLEND_OPAQUE, BLEND_ALPHA>
+            },
+            {
+                drawPixel<TWO_CYCLE, true, BLEND_ALPHA, BLEND_GENERIC>,
+                drawPixel<TWO_CYCLE, true, BLEND_ALPHA, BLEND_OPAQUE>,
+                drawPixel<TWO_CYCLE, true, BLEND_ALPHA, BLEND_ALPHA>
+            }
+        }
+    }
+};
+
+// Span functions for each triangle type, based on opcode bits 56-58
+// Entries with depth are replaced to match the depth compare and update settings
+void (*RDP::spanFuncs[8])(Span&) =
+{
+    drawSpan<false, false, false, false, false>, // Fill
+    drawSpan<false, false, true , false, false>, // Depth
+    drawSpan<false, true , false, false, false>, // Texture
+    drawSpan<false, true , true , false, false>, // Depth, texture
+    drawSpan<true , false, false, false, false>, // Shade
+    drawSpan<true , false, true , false, false>, // Depth, shade
+    drawSpan<true , true , false, false, false>, // Shade, texture
+    drawSpan<true , true , true , false, false>  // Depth, shade, texture
+};
+
 void RDP::reset()
 {
     // Reset the RDP to its initial state
@@ -215,7 +597,39 @@ void RDP::reset()
     addrBase = 0xA0000000;
     addrMask = 0xFFFFFF;
     paramCount = 0;
-    opcode.clear();
+    params.clear();
+    opcode = nullptr;
+    primitive = nullptr;
+    busy = false;
+    executed.store(0);
+    queued = 0;
+    syncWords = 0;
+    syncs = std::queue<uint32_t>();
+    primitives = std::queue<Primitive>();
+    colorStart = zStart = -1;
+    colorEnd = zEnd = 0;
+    trackColorAddr = 0;
+    trackColorWidth = 0;
+    trackColorSize = 2;
+    trackZAddr = 0;
+    trackScissorX = 0;
+    trackScissorY = 0;
+    memset(displays, 0, sizeof(displays));
+    displayCount = 0;
+    drawDisplay = nullptr;
+    skipColorAddr = 0;
+    skipZUpdate = false;
+    skipping = false;
+    skipped = false;
+    skipRatio = 0;
+    skipFrames = 0;
+    governorFrames = 0;
+    governorFast = 0;
+    governorTime = std::chrono::steady_clock::now();
+    memset(stateWords, 0, sizeof(stateWords));
+    memset(tileWords, 0, sizeof(tileWords));
+    memset(tileSizeWords, 0, sizeof(tileSizeWords));
+    stateFilter = Settings::texFilter;
     cycleType = ONE_CYCLE;
     texFilter = false;
     blendA[0] = blendA[1] = 0;
@@ -235,6 +649,8 @@ void RDP::reset()
     colorWidth = 0;
     colorFormat = RGBA4;
     memset(tiles, 0, sizeof(tiles));
+    for (int i = 0; i < 8; i++)
+        tiles[i].texels = texCache[i];
     scissorX1 = 0;
     scissorX2 = 0;
     scissorY1 = 0;
@@ -263,6 +679,69 @@ void RDP::reset()
         combineC[i] = &maxColor;
         combineD[i] = &minColor;
     }
+    combineKinds[0] = combineKinds[1] = COMBINE_GENERIC;
+    combinerCount = 0;
+    colorBuffer = zBuffer = Memory::rdram;
+    colorPitch = zPitch = 0;
+    colorLines = zLines = 0;
+    capturing = false;
+    capture.clear();
+    captureStart = 0;
+    captureRanges.clear();
+    captureBuffers.clear();
+    pixelCount = 0;
+    drawnCount = rejectCount = texelCount = 0;
+    tmemCount = skipCount = 0;
+    memset(&stats, 0, sizeof(stats));
+    memset(&frameStats, 0, sizeof(frameStats));
+    otherModes = 0;
+    combineMode = 0;
+    memset(zBlocks, 0, sizeof(zBlocks));
+    zGeneration = 1;
+    zBlockOffset = zBlockSize = zBlockPitch = zBlockWrites = 0;
+    coarseDepth = false;
+    markColorOffset = markZOffset = -1;
+    markColorSize = markZSize = 0;
+    colorWatch = zWatch = 0;
+    memset(uploads, 0, sizeof(uploads));
+    memset(blockOwners, 0, sizeof(blockOwners));
+    uploadCount = 0;
+
+    // Build the shared pixel format tables
+    Pixel::init();
+
+    // Precompute reciprocals for the blender, so it can multiply instead of divide
+    // These are exact for every numerator the blender can produce with each scale
+    for (int i = 1; i < 0x200; i++)
+        blendRecips[i] = ((1ULL << 32) + i - 1) / i;
+
+    // Precompute reciprocals for perspective correction, rounded down so quotient estimates are never too high
+    for (int i = 1; i <= 0x10000; i++)
+        perspRecips[i] = 0xFFFFFFFF / i;
+
+    // Precompute texture filter weights for each subtexel position, packed as (C << 24) | (L3 << 16) | (L2 << 8) | L1
+    // C selects the triangle of texels to blend, and each weight is between 0 and 0x20
+    for (int t = 0; t < 0x20; t++)
+    {
+        for (int s = 0; s < 0x20; s++)
+        {
+            int c = (s + t > 0x1F); // Below the diagonal
+            int v1x = (0 - c) << 5, v1y = (1 - c) << 5;
+            int v2x = (1 - c) << 5, v2y = (0 - c) << 5;
+            int v3x = s - (c << 5);
+            int v3y = t - (c << 5);
+            int den = (v1x * v2y - v2x * v1y) >> 5;
+            int l2 = abs((v3x * v2y - v2x * v3y) / den);
+            int l3 = abs((v1x * v3y - v3x * v1y) / den);
+            int l1 = 0x20 - l2 - l3;
+            filterWeights[(t << 5) | s] = (c << 24) | (l3 << 16) | (l2 << 8) | l1;
+        }
+    }
+
+    // Select the default sampler and pixel functions
+    for (int i = 0; i < 8; i++)
+        updateSampler(tiles[i]);
+    updatePipeline();
 }
 
 uint32_t RDP::read(int index)
@@ -335,24 +814,256 @@ void RDP::write(int index, uint32_t value)
     }
 }
 
-inline uint32_t RDP::RGBA16toRGBA32(uint16_t color)
+template <typename T> inline T RDP::readBuffer(uint8_t *data)
+{
+    // Read a value from a host pointer into RDRAM, big-endian style (MSB first)
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+        value |= (T)data[i] << ((sizeof(T) - 1 - i) * 8);
+    return value;
+}
+
+template <typename T> inline void RDP::writeBuffer(uint8_t *data, T value)
+{
+    // Write a value to a host pointer into RDRAM, big-endian style (MSB first)
+    for (size_t i = 0; i < sizeof(T); i++)
+        data[i] = value >> ((sizeof(T) - 1 - i) * 8);
+}
+
+template <typename T> inline T RDP::readRdram(uint32_t address)
+{
+    // Read a value from RDRAM, or 0 if out of bounds
+    // The RDP accesses RDRAM directly so its thread never waits on itself through the memory map
+    uint32_t pAddr = address & 0x1FFFFFFF;
+    if (pAddr >= Memory::ramSize)
+        return 0;
+    return readBuffer<T>(&Memory::rdram[pAddr]);
+}
+
+template <typename T> inline void RDP::writeRdram(uint32_t address, T value)
+{
+    // Write a value to RDRAM, or nowhere if out of bounds
+    uint32_t pAddr = address & 0x1FFFFFFF;
+    if (pAddr >= Memory::ramSize)
+        return;
+    writeBuffer<T>(&Memory::rdram[pAddr], value);
+}
+
+void RDP::resolveBuffers()
+{
+    // Resolve the color and Z buffers to host pointers once per primitive, so pixels can skip address translation
+    uint32_t colorOffset = std::min(colorAddress & 0x1FFFFFFF, Memory::ramSize);
+    uint32_t zOffset = std::min(zAddress & 0x1FFFFFFF, Memory::ramSize);
+    uint32_t colorSize = (colorFormat == RGBA16) ? 2 : 4;
+    colorBuffer = &Memory::rdram[colorOffset];
+    zBuffer = &Memory::rdram[zOffset];
+    colorPitch = colorWidth * colorSize;
+    zPitch = colorWidth * 2;
+
+    // Count the lines that fit in RDRAM up to the right scissor bound, so drawing can be clipped per line
+    // Lines that would cross the end of RDRAM are skipped entirely rather than checked pixel by pixel
+    uint32_t colorSpan = colorOffset + scissorX2 * colorSize;
+    uint32_t zSpan = zOffset + scissorX2 * 2;
+    colorLines = (colorSpan <= Memory::ramSize) ? (Memory::ramSize - colorSpan) / std::max(colorPitch, 1U) + 1 : 0;
+    zLines = (zSpan <= Memory::ramSize) ? (Memory::ramSize - zSpan) / std::max(zPitch, 1U) + 1 : 0;
+
+    // Get the sizes of the buffer areas the primitive can draw to, including pixels past the width on the last line
+    int lines = std::min<int>(scissorY2, colorLines);
+    uint32_t colorBytes = lines ? (lines - 1) * colorPitch + std::max<uint32_t>(colorWidth, scissorX2) * colorSize : 0;
+    lines = std::min<int>(scissorY2, zLines);
+    uint32_t zBytes = lines ? (lines - 1) * zPitch + std::max<uint32_t>(colorWidth, scissorX2) * 2 : 0;
+
+    // Capture the buffers before the primitive draws to them, if capturing a frame
+    if (capturing)
+    {
+        captureMemory(CAPTURE_BUFFER, colorOffset, colorBytes);
+        if (zCompare || zUpdate)
+            captureMemory(CAPTURE_BUFFER, zOffset, zBytes);
+    }
+
+    // Count writes to the pages the primitive can draw to, so uploads from rendered textures aren't skipped
+    // A mark only needs to be redone if the area changed or the counts were compared since the last one
+    uint32_t watch = Memory::watchCount();
+    if (colorOffset != markColorOffset || colorBytes != markColorSize || watch != colorWatch)
+    {
+        Memory::markWritten(colorOffset, colorBytes);
+        markColorOffset = colorOffset;
+        markColorSize = colorBytes;
+        colorWatch = watch;
+    }
+
+    if (zCompare || zUpdate)
+    {
+        // Invalidate the coarse depth blocks if the Z buffer moved, or if anything but Z updates wrote to it
+        // This catches the CPU, DMAs, and color writes like fill rectangles that target the Z buffer
+        uint32_t writes = Memory::countWrites(zOffset, zBytes);
+        if (zOffset != zBlockOffset || zBytes != zBlockSize || zPitch != zBlockPitch || writes != zBlockWrites)
+        {
+            if (++zGeneration == 0) zGeneration = 1;
+            zBlockOffset = zOffset;
+            zBlockSize = zBytes;
+            zBlockPitch = zPitch;
+        }
+
+        // Mark color writes again if they overlap the Z buffer, so the next check sees them
+        if (colorOffset < zOffset + zBytes && zOffset < colorOffset + colorBytes)
+            markColorOffset = -1;
+
+        // Count Z updates separately, since they keep the blocks they touch up to date
+        if (zUpdate && (zOffset != markZOffset || zBytes != markZSize || watch != zWatch))
+        {
+            Memory::markWritten(zOffset, zBytes);
+            markZOffset = zOffset;
+            markZSize = zBytes;
+            zWatch = watch;
+            writes = Memory::countWrites(zOffset, zBytes);
+        }
+        zBlockWrites = writes;
+    }
+
+    // Use coarse depth tests when the mode allows it and lines can't wrap into each other
+    coarseDepth = zCompare && zMode != 3 && scissorX2 <= colorWidth;
+}
+
+void RDP::buildBlock(ZBlock &block, int x, int y)
+{
+    // Find the minimum and maximum depth in an 8x8 block of the Z buffer, within RDRAM
+    uint32_t offset = zBuffer - Memory::rdram;
+    int x1 = x & ~0x7, x2 = std::min<int>(x1 + 8, colorWidth);
+    block.min = 0xFFFF;
+    block.max = 0x0000;
+    for (int j = y & ~0x7; j < (y & ~0x7) + 8; j++)
+    {
+        uint32_t line = offset + j * zPitch;
+        int end = (line < Memory::ramSize) ? std::min<int>(x2, (Memory::ramSize - line) / 2) : 0;
+        for (int i = x1; i < end; i++)
+        {
+            uint16_t m = readBuffer<uint16_t>(&zBuffer[j * zPitch + i * 2]);
+            block.min = std::min(block.min, m);
+            block.max = std::max(block.max, m);
+        }
+    }
+    block.generation = zGeneration;
+}
+
+int RDP::testBlock(int x, int y, int count, int32_t z, int32_t dzdx)
+{
+    // Get the range of depth values for pixels in a block, giving up if it would wrap
+    int64_t z1 = z, z2 = z + (int64_t)dzdx * (count - 1);
+    int64_t low = std::min(z1, z2), high = std::max(z1, z2);
+    if (low < INT32_MIN || high > INT32_MAX || (low < 0 && high >= 0))
+        return 0;
+
+    // Compare the range with the block's depth bounds, rebuilding them if they're out of date
+    ZBlock &block = zBlocks[((y >> 3) << 7) | (x >> 3)];
+    if (block.generation != zGeneration)
+        buildBlock(block, x, y);
+    if (block.max <= (uint16_t)(low >> 16))
+        return -1; // All fail
+    if (block.min > (uint16_t)(high >> 16))
+        return 1; // All pass
+    return 0;
+}
+
+void RDP::dirtyBlocks(Span &span)
+{
+    // Mark the blocks covered by a span as out of date after its Z updates
+    int x1 = span.x, x2 = span.x + (span.count - 1) * span.inc;
+    if (std::max(x1, x2) >= colorWidth)
+    {
+        // Invalidate all blocks if the span wrapped into the next line
+        if (++zGeneration == 0) zGeneration = 1;
+        return;
+    }
+    ZBlock *row = &zBlocks[(span.y >> 3) << 7];
+    for (int i = std::min(x1, x2) >> 3; i <= std::max(x1, x2) >> 3; i++)
+        row[i].generation = 0;
+}
+
+uint64_t RDP::tmemBlocks(uint32_t address, uint32_t size)
 {
-    // Convert an RGBA16 color to RGBA32
-    uint8_t r = ((color >> 8) & 0xF8) | ((color >> 13) & 0x7);
-    uint8_t g = ((color >> 3) & 0xF8) | ((color >>  8) & 0x7);
-    uint8_t b = ((color << 2) & 0xF8) | ((color >>  3) & 0x7);
-    uint8_t a = (color & 0x1) ? 0xFF : 0x00;
-    return (r << 24) | (g << 16) | (b << 8) | a;
+    // Get a mask of the 64-byte TMEM blocks covered by a range, with wraparound
+    if (size >= 0x1000) return -1;
+    uint64_t blocks = 0;
+    for (uint32_t i = address >> 6; i <= (address + size - 1) >> 6; i++)
+        blocks |= 1ULL << (i & 0x3F);
+    return blocks;
 }
 
-inline uint16_t RDP::RGBA32toRGBA16(uint32_t color)
+bool RDP::skipUpload(uint32_t address, uint32_t size, int rows, uint64_t blocks)
 {
-    // Convert an RGBA32 color to RGBA16
-    uint8_t r = ((color >> 27) & 0x1F);
-    uint8_t g = ((color >> 19) & 0x1F);
-    uint8_t b = ((color >> 11) & 0x1F);
-    uint8_t a = (color & 0xFF) ? 0x1 : 0x0;
-    return (r << 11) | (g << 6) | (b << 1) | a;
+    // Build a key from the command and the state that determines what gets written to TMEM
+    Tile &tile = tiles[(opcode[0] >> 24) & 0x7];
+    Upload key = { opcode[0], texAddress, texWidth, texFormat, tile.address, tile.width, tile.format };
+    uint32_t stride = (texWidth << (texFormat & 0x3)) >> 1;
+    address &= 0x1FFFFFFF;
+
+    // Capture the source data if capturing a frame
+    if (capturing)
+    {
+        for (int r = 0; r < rows; r++)
+            captureMemory(CAPTURE_MEMORY, address + r * stride, size);
+    }
+
+    // Look for a previous upload with the same key
+    Upload *upload = nullptr;
+    for (int i = 0; i < 16 && !upload; i++)
+    {
+        Upload &u = uploads[i];
+        if (u.id && u.command == key.command && u.texAddress == key.texAddress && u.texWidth == key.texWidth &&
+            u.texFormat == key.texFormat && u.tileAddress == key.tileAddress && u.tileWidth == key.tileWidth &&
+            u.tileFormat == key.tileFormat)
+            upload = &u;
+    }
+
+    // Sum the write counts of the source pages, to tell if the data might have changed
+    // Watching the counts makes the next primitive mark its buffers again, so later drawing is counted
+    Memory::watchWrites();
+    uint32_t writes = 0;
+    for (int r = 0; r < rows; r++)
+        writes += Memory::countWrites(address + r * stride, size);
+
+    // Hash the source data, unless the previous hash is known to still be valid
+    uint64_t hash = 0xCBF29CE484222325;
+    if (upload && upload->writes == writes)
+    {
+        hash = upload->hash;
+    }
+    else
+    {
+        for (int r = 0; r < rows; r++)
+        {
+            uint32_t start = address + r * stride, end = std::min(start + size, Memory::ramSize);
+            for (uint32_t i = start; i + 8 <= end; i += 8)
+                hash = (hash ^ readBuffer<uint64_t>(&Memory::rdram[i])) * 0x100000001B3;
+            for (uint32_t i = std::max(start, end & ~0x7); i < end; i++)
+                hash = (hash ^ Memory::rdram[i]) * 0x100000001B3;
+        }
+    }
+
+    // Skip the upload if it would write the same data and nothing else has written to its TMEM blocks since
+    if (upload && upload->hash == hash)
+    {
+        bool owned = true;
+        for (int i = 0; i < 64 && owned; i++)
+            owned = !((upload->blocks >> i) & 0x1) || blockOwners[i] == upload->id;
+        if (owned)
+        {
+            skipCount++;
+            return true;
+        }
+    }
+
+    // Record the upload, replacing the oldest entry if the key is new
+    if (!upload) upload = &uploads[uploadCount & 0xF];
+    *upload = key;
+    upload->hash = hash;
+    upload->writes = writes;
+    upload->blocks = blocks;
+    upload->id = ++uploadCount;
+    for (int i = 0; i < 64; i++)
+        if ((blocks >> i) & 0x1) blockOwners[i] = upload->id;
+    return false;
 }
 
 inline uint32_t RDP::colorToAlpha(uint32_t color)
@@ -362,15 +1073,15 @@ inline uint32_t RDP::colorToAlpha(uint32_t color)
     return (a << 24) | (a << 16) | (a << 8) | a;
 }
 
-uint32_t RDP::getTexel(Tile &tile, int s, int t, bool rect)
+template <int format, bool filter, bool cached> uint32_t RDP::getTexel(Tile &tile, int s, int t, bool rect)
 {
     // Offset the texture coordinates relative to the tile
     s -= tile.sBase;
     t -= tile.tBase;
 
-    // Fall back to nearest sampling when appropriate
-    if (!Settings::texFilter || !texFilter || cycleType >= COPY_MODE)
-        return getRawTexel(tile, s >> 5, t >> 5);
+    // Use nearest sampling if the sampler wasn't selected for filtering
+    if (!filter)
+        return fetchTexel<format, cached>(tile, s >> 5, t >> 5);
 
     // Subtract 0.5 from triangle texture coordinates
     // TODO: verify rectangle behavior
@@ -380,31 +1091,48 @@ uint32_t RDP::getTexel(Tile &tile, int s, int t, bool rect)
         t -= 0x10;
     }
 
-    // Load 3 texels for blending based on if the point is above or below the diagonal
-    bool c = ((s & 0x1F) + (t & 0x1F) > 0x1F); // Below
-    uint32_t col1 = getRawTexel(tile, (s >> 5) + c, (t >> 5) + c);
-    uint32_t col2 = getRawTexel(tile, (s >> 5) + 0, (t >> 5) + 1);
-    uint32_t col3 = getRawTexel(tile, (s >> 5) + 1, (t >> 5) + 0);
+    // Look up the weights for the subtexel position, and load 3 texels based on if it's above or below the diagonal
+    uint32_t weights = filterWeights[((t & 0x1F) << 5) | (s & 0x1F)];
+    int c = weights >> 24;
+    uint32_t col1 = fetchTexel<format, cached>(tile, (s >> 5) + c, (t >> 5) + c);
+    uint32_t col2 = fetchTexel<format, cached>(tile, (s >> 5) + 0, (t >> 5) + 1);
+    uint32_t col3 = fetchTexel<format, cached>(tile, (s >> 5) + 1, (t >> 5) + 0);
+    uint32_t l1 = (weights >> 0) & 0xFF;
+    uint32_t l2 = (weights >> 8) & 0xFF;
+    uint32_t l3 = (weights >> 16) & 0xFF;
+
+    // Blend two channels per multiply, with each channel in a 16-bit lane
+    // Weights add up to 0x20, so blended channels stay within 13 bits and never carry into the next lane
+    uint32_t rb = ((col1 & 0xFF00FF) * l1 + (col2 & 0xFF00FF) * l2 + (col3 & 0xFF00FF) * l3) >> 5;
+    uint32_t ga = (((col1 >> 8) & 0xFF00FF) * l1 + ((col2 >> 8) & 0xFF00FF) * l2 + ((col3 >> 8) & 0xFF00FF) * l3) >> 5;
+    return (rb & 0xFF00FF) | ((ga & 0xFF00FF) << 8);
+}
 
-    // Calculate weights for each texel
-    int v1x = (0 - c) << 5, v1y = (1 - c) << 5;
-    int v2x = (1 - c) << 5, v2y = (0 - c) << 5;
-    int v3x = (s & 0x1F) - (c << 5);
-    int v3y = (t & 0x1F) - (c << 5);
-    int den = (v1x * v2y - v2x * v1y) >> 5;
-    int l2 = abs((v3x * v2y - v2x * v3y) / den);
-    int l3 = abs((v1x * v3y - v3x * v1y) / den);
-    int l1 = 0x20 - l2 - l3;
+template <int format, bool filter> uint32_t RDP::buildTexels(Tile &tile, int s, int t, bool rect)
+{
+    // Decode the tile's wrapped area to RGBA32 texels, including mirrored copies
+    for (int y = 0; y <= tile.tWrap; y++)
+        for (int x = 0; x <= tile.sWrap; x++)
+            tile.texels[(y << tile.shift) + x] = getRawTexel<format>(tile, x, y);
+
+    // Sample from the decoded texels until TMEM or the tile changes
+    tile.sampler = getTexel<format, filter, true>;
+    return getTexel<format, filter, true>(tile, s, t, rect);
+}
 
-    // Blend each channel of the output filtered texel
-    uint8_t r = (((col1 >> 24) & 0xFF) * l1 + ((col2 >> 24) & 0xFF) * l2 + ((col3 >> 24) & 0xFF) * l3) >> 5;
-    uint8_t g = (((col1 >> 16) & 0xFF) * l1 + ((col2 >> 16) & 0xFF) * l2 + ((col3 >> 16) & 0xFF) * l3) >> 5;
-    uint8_t b = (((col1 >>  8) & 0xFF) * l1 + ((col2 >>  8) & 0xFF) * l2 + ((col3 >>  8) & 0xFF) * l3) >> 5;
-    uint8_t a = (((col1 >>  0) & 0xFF) * l1 + ((col2 >>  0) & 0xFF) * l2 + ((col3 >>  0) & 0xFF) * l3) >> 5;
-    return (r << 24) | (g << 16) | (b << 8) | a;
+template <int format, bool cached> inline uint32_t RDP::fetchTexel(Tile &tile, int s, int t)
+{
+    // Decode a texel directly from TMEM if the tile isn't cached
+    if (!cached)
+        return getRawTexel<format>(tile, s, t);
+
+    // Clamp or wrap the coordinates within the decoded area, which already accounts for mirroring
+    s = tile.sClamp ? std::max<int>(std::min<int>(s, tile.sWrap), 0) : (s & tile.sWrap);
+    t = tile.tClamp ? std::max<int>(std::min<int>(t, tile.tWrap), 0) : (t & tile.tWrap);
+    return tile.texels[(t << tile.shift) + s];
 }
 
-uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
+template <int format> uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
 {
     // Clamp, mirror, or mask the S-coordinate based on tile settings
     if (tile.sClamp)
@@ -423,14 +1151,15 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
         t &= tile.tMask;
 
     // Get an RGBA32 texel from a tile at the given coordinates
-    switch (tile.format)
+    // The format is known at compile time for specialized samplers, and read from the tile otherwise
+    switch ((format < 0) ? tile.format : format)
     {
         case RGBA16:
         {
             // Convert an RGBA16 texel to RGBA32, swapping 32-bit words on odd lines
             s ^= tile.width ? (((t + (s * 2) / tile.width) & 0x1) << 1) : 0;
             uint8_t *value = &tmem[(tile.address + t * tile.width + s * 2) & 0xFFE];
-            return RGBA16toRGBA32((value[0] << 8) | value[1]);
+            return Pixel::rgba16To32((value[0] << 8) | value[1]);
         }
 
         case RGBA32:
@@ -448,7 +1177,7 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
             s ^= tile.width ? (((t + (s / 2) / tile.width) & 0x1) << 3) : 0;
             uint8_t index = (tmem[(tile.address + t * tile.width + s / 2) & 0xFFF] >> (~s & 1) * 4) & 0xF;
             uint8_t *value = &tmem[(0x800 + (tile.palette + index) * 8) & 0xFF8];
-            return RGBA16toRGBA32((value[0] << 8) | value[1]);
+            return Pixel::rgba16To32((value[0] << 8) | value[1]);
         }
 
         case CI8:
@@ -457,7 +1186,7 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
             s ^= tile.width ? (((t + s / tile.width) & 0x1) << 2) : 0;
             uint8_t index = tmem[(tile.address + t * tile.width + s) & 0xFFF];
             uint8_t *value = &tmem[(0x800 + index * 8) & 0xFF8];
-            return RGBA16toRGBA32((value[0] << 8) | value[1]);
+            return Pixel::rgba16To32((value[0] << 8) | value[1]);
         }
 
         case IA4:
@@ -465,9 +1194,7 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
             // Convert an IA4 texel to RGBA32, swapping 32-bit words on odd lines
             s ^= tile.width ? (((t + (s / 2) / tile.width) & 0x1) << 3) : 0;
             uint8_t value = tmem[(tile.address + t * tile.width + s / 2) & 0xFFF] >> (~s & 1) * 4;
-            uint8_t i = ((value << 4) & 0xE0) | ((value << 1) & 0x1C) | ((value >> 2) & 0x3);
-            uint8_t a = (value & 0x1) ? 0xFF : 0x0;
-            return (i << 24) | (i << 16) | (i << 8) | a;
+            return Pixel::ia4To32(value);
         }
 
         case IA8:
@@ -475,9 +1202,7 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
             // Convert an IA8 texel to RGBA32, swapping 32-bit words on odd lines
             s ^= tile.width ? (((t + s / tile.width) & 0x1) << 2) : 0;
             uint8_t value = tmem[(tile.address + t * tile.width + s) & 0xFFF];
-            uint8_t i = (value & 0xF0) | (value >> 4);
-            uint8_t a = (value & 0x0F) | (value << 4);
-            return (i << 24) | (i << 16) | (i << 8) | a;
+            return Pixel::ia8To32(value);
         }
 
         case IA16:
@@ -495,8 +1220,7 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
             // Convert an I4 texel to RGBA32, swapping 32-bit words on odd lines
             s ^= tile.width ? (((t + (s / 2) / tile.width) & 0x1) << 3) : 0;
             uint8_t value = tmem[(tile.address + t * tile.width + s / 2) & 0xFFF] >> (~s & 1) * 4;
-            uint8_t i = (value << 4) | (value & 0xF);
-            return (i << 24) | (i << 16) | (i << 8) | i;
+            return Pixel::i4To32(value & 0xF);
         }
 
         case I8:
@@ -513,11 +1237,12 @@ uint32_t RDP::getRawTexel(Tile &tile, int s, int t)
     }
 }
 
-bool RDP::blendPixel(bool cycle, uint32_t &color)
+template <int mode> bool RDP::blendPixel(bool cycle, uint32_t &color)
 {
     // Select the first color for blending
+    // The inputs are known at compile time for specialized modes, and read from the current settings otherwise
     uint32_t color1;
-    switch (blendA[cycle])
+    switch ((mode < 0) ? blendA[cycle] : ((mode >> 6) & 0x3))
     {
         case 0: color1 = combColor;  break;
         case 1: color1 = memColor;   break;
@@ -527,7 +1252,7 @@ bool RDP::blendPixel(bool cycle, uint32_t &color)
 
     // Select the scale for the first color
     uint8_t scale1;
-    switch (blendB[cycle])
+    switch ((mode < 0) ? blendB[cycle] : ((mode >> 4) & 0x3))
     {
         case 0: scale1 = pixelAlpha; break;
         case 1: scale1 = fogColor;   break;
@@ -537,7 +1262,7 @@ bool RDP::blendPixel(bool cycle, uint32_t &color)
 
     // Select the second color for blending
     uint32_t color2;
-    switch (blendC[cycle])
+    switch ((mode < 0) ? blendC[cycle] : ((mode >> 2) & 0x3))
     {
         case 0: color2 = combColor;  break;
         case 1: color2 = memColor;   break;
@@ -547,7 +1272,7 @@ bool RDP::blendPixel(bool cycle, uint32_t &color)
 
     // Select the scale for the second color
     uint8_t scale2;
-    switch (blendD[cycle])
+    switch ((mode < 0) ? blendD[cycle] : ((mode >> 0) & 0x3))
     {
         case 0: scale2 = ~scale1;  break;
         case 1: scale2 = memColor; break;
@@ -555,12 +1280,13 @@ bool RDP::blendPixel(bool cycle, uint32_t &color)
         case 3: scale2 = 0x00;     break;
     }
 
-    // Blend the colors to form a new color
+    // Blend the colors to form a new color, multiplying by the scale's reciprocal instead of dividing
     if (uint16_t scale = scale1 + scale2)
     {
-        uint8_t r = (((color1 >> 24) & 0xFF) * scale1 + ((color2 >> 24) & 0xFF) * scale2) / scale;
-        uint8_t g = (((color1 >> 16) & 0xFF) * scale1 + ((color2 >> 16) & 0xFF) * scale2) / scale;
-        uint8_t b = (((color1 >>  8) & 0xFF) * scale1 + ((color2 >>  8) & 0xFF) * scale2) / scale;
+        uint64_t recip = blendRecips[scale];
+        uint8_t r = ((((color1 >> 24) & 0xFF) * scale1 + ((color2 >> 24) & 0xFF) * scale2) * recip) >> 32;
+        uint8_t g = ((((color1 >> 16) & 0xFF) * scale1 + ((color2 >> 16) & 0xFF) * scale2) * recip) >> 32;
+        uint8_t b = ((((color1 >>  8) & 0xFF) * scale1 + ((color2 >>  8) & 0xFF) * scale2) * recip) >> 32;
         color = (r << 24) | (g << 16) | (b << 8);
         return true;
     }
@@ -568,18 +1294,59 @@ bool RDP::blendPixel(bool cycle, uint32_t &color)
     return false;
 }
 
-bool RDP::drawPixel(int x, int y)
+inline int32_t RDP::perspDivide(int32_t value, int32_t divisor)
 {
-    switch (cycleType)
+    // Divide magnitudes by multiplying with a reciprocal, which gives the quotient or one less
+    // The estimate is corrected using the remainder, so the result matches integer division exactly
+    uint32_t n = (value < 0) ? -(uint32_t)value : value;
+    uint32_t d = (divisor < 0) ? -(uint32_t)divisor : divisor;
+    uint32_t q = ((uint64_t)n * perspRecips[d]) >> 32;
+    if (n - q * d >= d) q++;
+
+    // Apply the sign, truncating toward zero like integer division
+    return ((value ^ divisor) < 0) ? -(int32_t)q : q;
+}
+
+template <int cycle> inline uint32_t RDP::combinePixel()
+{
+    // Combine RGBA channels for a cycle, using a simpler formula if the combine mode allows it
+    switch (combineKinds[cycle])
+    {
+        case COMBINE_D:
+            // Pass through the D inputs
+            return (*combineD[cycle] & ~0xFF) | (*combineD[cycle + 2] & 0xFF);
+
+        case COMBINE_MULTIPLY:
+        {
+            // Multiply the A and C inputs, since B and D are 0
+            uint8_t r = (((*combineA[cycle] >> 24) & 0xFF) * ((*combineC[cycle] >> 24) & 0xFF)) / 0xFF;
+            uint8_t g = (((*combineA[cycle] >> 16) & 0xFF) * ((*combineC[cycle] >> 16) & 0xFF)) / 0xFF;
+            uint8_t b = (((*combineA[cycle] >>  8) & 0xFF) * ((*combineC[cycle] >>  8) & 0xFF)) / 0xFF;
+            uint8_t a = (((*combineA[cycle + 2] >> 0) & 0xFF) * ((*combineC[cycle + 2] >> 0) & 0xFF)) / 0xFF;
+            return (r << 24) | (g << 16) | (b << 8) | a;
+        }
+
+        default:
+        {
+            // Use the formula (A - B) * C + D
+            uint8_t r = (((((*combineA[cycle] >> 24) - (*combineB[cycle] >> 24)) & 0xFF) * ((*combineC[cycle] >> 24) & 0xFF)) / 0xFF) + (*combineD[cycle] >> 24);
+            uint8_t g = (((((*combineA[cycle] >> 16) - (*combineB[cycle] >> 16)) & 0xFF) * ((*combineC[cycle] >> 16) & 0xFF)) / 0xFF) + (*combineD[cycle] >> 16);
+            uint8_t b = (((((*combineA[cycle] >>  8) - (*combineB[cycle] >>  8)) & 0xFF) * ((*combineC[cycle] >>  8) & 0xFF)) / 0xFF) + (*combineD[cycle] >>  8);
+            uint8_t a = (((((*combineA[cycle + 2] >> 0) - (*combineB[cycle + 2] >> 0)) & 0xFF) * ((*combineC[cycle + 2] >> 0) & 0xFF)) / 0xFF) + (*combineD[cycle + 2] >> 0);
+            return (r << 24) | (g << 16) | (b << 8) | a;
+        }
+    }
+}
+
+template <CycleType type, bool rgba16, int mode0, int mode1> bool RDP::drawPixel(int x, uint8_t *line)
+{
+    // Draw a pixel using the cycle type, color format, and blender modes the function was specialized for
+    switch (type)
     {
         case ONE_CYCLE:
         {
-            // Combine cycle 0 RGBA channels using the formula (A - B) * C + D
-            uint8_t r = (((((*combineA[0] >> 24) - (*combineB[0] >> 24)) & 0xFF) * ((*combineC[0] >> 24) & 0xFF)) / 0xFF) + (*combineD[0] >> 24);
-            uint8_t g = (((((*combineA[0] >> 16) - (*combineB[0] >> 16)) & 0xFF) * ((*combineC[0] >> 16) & 0xFF)) / 0xFF) + (*combineD[0] >> 16);
-            uint8_t b = (((((*combineA[0] >>  8) - (*combineB[0] >>  8)) & 0xFF) * ((*combineC[0] >>  8) & 0xFF)) / 0xFF) + (*combineD[0] >>  8);
-            uint8_t a = (((((*combineA[2] >>  0) - (*combineB[2] >>  0)) & 0xFF) * ((*combineC[2] >>  0) & 0xFF)) / 0xFF) + (*combineD[2] >>  0);
-            combColor = (r << 24) | (g << 16) | (b << 8) | a;
+            // Combine cycle 0 RGBA channels
+            combColor = combinePixel<0>();
             pixelAlpha = combAlpha = colorToAlpha(combColor);
 
             // Coverage isn't implemented yet, but pixels with coverage 0 seem to be unconditionally skipped
@@ -587,23 +1354,23 @@ bool RDP::drawPixel(int x, int y)
             if (alphaMultiply && !pixelAlpha)
                 return false;
 
-            if (colorFormat == RGBA16)
+            if (rgba16)
             {
                 // Blend the pixel with the previous RGBA16 pixel in the color buffer
-                memColor = RGBA16toRGBA32(Memory::read<uint16_t>(colorAddress + (y * colorWidth + x) * 2)) & ~0xFF;
-                if (blendPixel(false, memColor))
+                memColor = Pixel::rgba16To32(readBuffer<uint16_t>(&line[x * 2])) & ~0xFF;
+                if (blendPixel<mode0>(false, memColor))
                 {
-                    Memory::write<uint16_t>(colorAddress + (y * colorWidth + x) * 2, RGBA32toRGBA16(memColor | 0xFF));
+                    writeBuffer<uint16_t>(&line[x * 2], Pixel::rgba32To16(memColor | 0xFF));
                     return true;
                 }
             }
             else
             {
                 // Blend the pixel with the previous RGBA32 pixel in the color buffer
-                memColor = Memory::read<uint32_t>(colorAddress + (y * colorWidth + x) * 4) & ~0xFF;
-                if (blendPixel(false, memColor))
+                memColor = readBuffer<uint32_t>(&line[x * 4]) & ~0xFF;
+                if (blendPixel<mode0>(false, memColor))
                 {
-                    Memory::write<uint32_t>(colorAddress + (y * colorWidth + x) * 4, memColor | 0xFF);
+                    writeBuffer<uint32_t>(&line[x * 4], memColor | 0xFF);
                     return true;
                 }
             }
@@ -612,12 +1379,8 @@ bool RDP::drawPixel(int x, int y)
 
         case TWO_CYCLE:
         {
-            // Combine cycle 0 RGBA channels using the formula (A - B) * C + D
-            uint8_t r = (((((*combineA[0] >> 24) - (*combineB[0] >> 24)) & 0xFF) * ((*combineC[0] >> 24) & 0xFF)) / 0xFF) + (*combineD[0] >> 24);
-            uint8_t g = (((((*combineA[0] >> 16) - (*combineB[0] >> 16)) & 0xFF) * ((*combineC[0] >> 16) & 0xFF)) / 0xFF) + (*combineD[0] >> 16);
-            uint8_t b = (((((*combineA[0] >>  8) - (*combineB[0] >>  8)) & 0xFF) * ((*combineC[0] >>  8) & 0xFF)) / 0xFF) + (*combineD[0] >>  8);
-            uint8_t a = (((((*combineA[2] >>  0) - (*combineB[2] >>  0)) & 0xFF) * ((*combineC[2] >>  0) & 0xFF)) / 0xFF) + (*combineD[2] >>  0);
-            combColor = (r << 24) | (g << 16) | (b << 8) | a;
+            // Combine cycle 0 RGBA channels
+            combColor = combinePixel<0>();
             pixelAlpha = combAlpha = colorToAlpha(combColor);
 
             // Coverage isn't implemented yet, but pixels with coverage 0 seem to be unconditionally skipped
@@ -626,28 +1389,24 @@ bool RDP::drawPixel(int x, int y)
                 return false;
 
             // Blend the pixel with the previous pixel in the color buffer
-            if (colorFormat == RGBA16)
-                memColor = RGBA16toRGBA32(Memory::read<uint16_t>(colorAddress + (y * colorWidth + x) * 2)) & ~0xFF;
+            if (rgba16)
+                memColor = Pixel::rgba16To32(readBuffer<uint16_t>(&line[x * 2])) & ~0xFF;
             else
-                memColor = Memory::read<uint32_t>(colorAddress + (y * colorWidth + x) * 4) & ~0xFF;
-            bool blend = blendPixel(false, combColor);
-
-            // Combine cycle 1 RGB channels using the formula (A - B) * C + D
-            r = (((((*combineA[1] >> 24) - (*combineB[1] >> 24)) & 0xFF) * ((*combineC[1] >> 24) & 0xFF)) / 0xFF) + (*combineD[1] >> 24);
-            g = (((((*combineA[1] >> 16) - (*combineB[1] >> 16)) & 0xFF) * ((*combineC[1] >> 16) & 0xFF)) / 0xFF) + (*combineD[1] >> 16);
-            b = (((((*combineA[1] >>  8) - (*combineB[1] >>  8)) & 0xFF) * ((*combineC[1] >>  8) & 0xFF)) / 0xFF) + (*combineD[1] >>  8);
-            a = (((((*combineA[3] >>  0) - (*combineB[3] >>  0)) & 0xFF) * ((*combineC[3] >>  0) & 0xFF)) / 0xFF) + (*combineD[3] >>  0);
-            combColor = (r << 24) | (g << 16) | (b << 8) | a;
+                memColor = readBuffer<uint32_t>(&line[x * 4]) & ~0xFF;
+            bool blend = blendPixel<mode0>(false, combColor);
+
+            // Combine cycle 1 RGBA channels
+            combColor = combinePixel<1>();
             combAlpha = colorToAlpha(combColor);
 
             // Blend the pixel again and write it to the color buffer
             uint32_t color = combColor;
-            if (blendPixel(true, color) || blend)
+            if (blendPixel<mode1>(true, color) || blend)
             {
-                if (colorFormat == RGBA16)
-                    Memory::write<uint16_t>(colorAddress + (y * colorWidth + x) * 2, RGBA32toRGBA16(color | 0xFF));
+                if (rgba16)
+                    writeBuffer<uint16_t>(&line[x * 2], Pixel::rgba32To16(color | 0xFF));
                 else
-                    Memory::write<uint32_t>(colorAddress + (y * colorWidth + x) * 4, color | 0xFF);
+                    writeBuffer<uint32_t>(&line[x * 4], color | 0xFF);
                 return true;
             }
             return false;
@@ -659,28 +1418,28 @@ bool RDP::drawPixel(int x, int y)
                 return false;
 
             // Copy a texel directly to the color buffer
-            if (colorFormat == RGBA16)
-                Memory::write<uint16_t>(colorAddress + (y * colorWidth + x) * 2, RGBA32toRGBA16(texelColor));
+            if (rgba16)
+                writeBuffer<uint16_t>(&line[x * 2], Pixel::rgba32To16(texelColor));
             else
-                Memory::write<uint32_t>(colorAddress + (y * colorWidth + x) * 4, texelColor);
+                writeBuffer<uint32_t>(&line[x * 4], texelColor);
             return true;
 
         case FILL_MODE:
             // Copy the fill color directly to the color buffer
-            if (colorFormat == RGBA16)
-                Memory::write<uint16_t>(colorAddress + (y * colorWidth + x) * 2, fillColor >> ((~x & 1) * 16));
+            if (rgba16)
+                writeBuffer<uint16_t>(&line[x * 2], fillColor >> ((~x & 1) * 16));
             else
-                Memory::write<uint32_t>(colorAddress + (y * colorWidth + x) * 4, fillColor);
+                writeBuffer<uint32_t>(&line[x * 4], fillColor);
             return true;
     }
 
     return false;
 }
 
-bool RDP::testDepth(int x, int y, int z)
+bool RDP::testDepth(int x, uint8_t *line, int z)
 {
-    // Read the existing depth value from memory
-    int m = Memory::read<uint16_t>(zAddress + (y * colorWidth + x) * 2);
+    // Read the existing depth value from the Z buffer line
+    int m = readBuffer<uint16_t>(&line[x * 2]);
 
     // Perform a depth test based on the current mode
     switch (zMode)
@@ -694,685 +1453,1475 @@ bool RDP::testDepth(int x, int y, int z)
     }
 }
 
-void RDP::finishThread()
+template <bool shade, bool texture, bool depth, bool compare, bool update> void RDP::drawSpan(Span &span)
 {
-    // Stop the thread if it was running
-    if (running)
+    // Copy the interpolated values locally so they don't have to be reloaded after each pixel
+    int32_t ra = span.r, ga = span.g, ba = span.b, aa = span.a;
+    int32_t sa = span.s, ta = span.t, wa = span.w, za = span.z;
+    int drawn = 0, rejected = 0, texels = 0;
+    Batch batch = {};
+
+#ifdef __SSE2__
+    // Interpolate shade components in parallel lanes, ordered so they pack into an RGBA32 color
+    __m128i shadeLanes = _mm_set_epi32(ra, ga, ba, aa);
+    __m128i shadeSteps = _mm_set_epi32(span.drdx, span.dgdx, span.dbdx, span.dadx);
+#endif
+
+    // Draw a line of pixels using only the attributes and depth settings the function was specialized for
+    for (int i = 0, x = span.x, next = 0, coarse = 0; i < span.count; i++, x += span.inc)
     {
-        running = false;
-        thread->join();
-        delete thread;
-    }
-}
+        if (compare && coarseDepth && i == next)
+        {
+            // Test the pixels within the next 8x8 block of the Z buffer against its depth bounds
+            int count = std::min(span.count - i, (span.inc > 0) ? (8 - (x & 0x7)) : ((x & 0x7) + 1));
+            coarse = testBlock(x, span.y, count, za, span.dzdx);
+            next = i + count;
 
-void RDP::runThreaded()
-{
-    while (true)
-    {
-        // Parse the next command if one is queued
-        mutex.lock();
-        uint8_t op = opcode.empty() ? 0 : ((opcode[0] >> 56) & 0x3F);
-        uint8_t count = paramCounts[op];
+            if (coarse < 0)
+            {
+                // Skip the pixels if they all fail, moving the interpolated values past them
+#ifdef __SSE2__
+                shadeLanes = _mm_add_epi32(shadeLanes, _mm_set_epi32(advance(0, span.drdx, count),
+                    advance(0, span.dgdx, count), advance(0, span.dbdx, count), advance(0, span.dadx, count)));
+#else
+                ra = advance(ra, span.drdx, count);
+                ga = advance(ga, span.dgdx, count);
+                ba = advance(ba, span.dbdx, count);
+                aa = advance(aa, span.dadx, count);
+#endif
+                sa = advance(sa, span.dsdx, count);
+                ta = advance(ta, span.dtdx, count);
+                wa = advance(wa, span.dwdx, count);
+                za = advance(za, span.dzdx, count);
+                rejected += count;
+                i += count - 1;
+                x += (count - 1) * span.inc;
+                continue;
+            }
+        }
 
-        if (opcode.size() >= count)
+        // Get the current pixel's depth value
+        uint16_t z = za >> 16;
+
+        // Draw a pixel if the depth test passes, with spans already clipped to scissor bounds
+        // The per-pixel test is skipped when the whole block is known to pass
+        if (!compare || coarse > 0 || testDepth(x, span.zLine, z))
         {
-            // Execute a command once all of its parameters have been queued
-            mutex.unlock();
-            (*commands[op])();
-            mutex.lock();
-            opcode.erase(opcode.begin(), opcode.begin() + count);
-            mutex.unlock();
+            if (shade)
+            {
+                // Update the shade color for the current pixel
+#ifdef __SSE2__
+                // Saturating packs clamp the components to 0-255 the same way as the scalar path
+                __m128i lanes = _mm_srai_epi32(shadeLanes, 16);
+                lanes = _mm_packs_epi32(lanes, lanes);
+                shadeColor = _mm_cvtsi128_si32(_mm_packus_epi16(lanes, lanes));
+#else
+                uint8_t r = std::max(0x00, std::min(0xFF, ra >> 16));
+                uint8_t g = std::max(0x00, std::min(0xFF, ga >> 16));
+                uint8_t b = std::max(0x00, std::min(0xFF, ba >> 16));
+                uint8_t a = std::max(0x00, std::min(0xFF, aa >> 16));
+                shadeColor = (r << 24) | (g << 16) | (b << 8) | a;
+#endif
+                shadeAlpha = colorToAlpha(shadeColor);
+            }
+
+            if (texture && (wa >> 15))
+            {
+                // Update the texel color for the current pixel, with perspective correction
+                // The W divisor fits in 17 bits, so a reciprocal table can replace the divisions
+                texelColor = (*span.tile->sampler)(*span.tile, perspDivide(sa, wa >> 15), perspDivide(ta, wa >> 15), false);
+                texelAlpha = colorToAlpha(texelColor);
+                texels++;
+            }
+
+            if (batchFunc)
+            {
+                // Queue the pixel so the combiner and blender can run on several at once
+                batch.x[batch.count] = x;
+                batch.shade[batch.count] = shadeColor;
+                batch.texel[batch.count] = texelColor;
+                batch.z[batch.count] = z;
+                if (++batch.count == 4)
+                    drawn += flushBatch<update>(batch, span);
+            }
+            else if ((*pixelFunc)(x, span.colorLine))
+            {
+                // Update the Z buffer if a pixel is drawn
+                if (update)
+                    writeBuffer<uint16_t>(&span.zLine[x * 2], z);
+                drawn++;
+            }
         }
         else
         {
-            // If requested, stop running when the queue is empty
-            mutex.unlock();
-            if (!running) return;
-            std::this_thread::yield();
+            rejected++;
+        }
+
+        // Interpolate the values across the line
+        if (shade)
+        {
+#ifdef __SSE2__
+            shadeLanes = _mm_add_epi32(shadeLanes, shadeSteps);
+#else
+            ra += span.drdx;
+            ga += span.dgdx;
+            ba += span.dbdx;
+            aa += span.dadx;
+#endif
+        }
+        if (texture)
+        {
+            sa += span.dsdx;
+            ta += span.dtdx;
+            wa += span.dwdx;
         }
+        if (depth)
+            za += span.dzdx;
     }
+
+    // Draw any pixels left in the batch, and add to the counters for statistics
+    if (batch.count)
+        drawn += flushBatch<update>(batch, span);
+    drawnCount += drawn;
+    rejectCount += rejected;
+    texelCount += texels;
+
+    // Mark coarse depth blocks as out of date if Z values might have changed
+    if (update)
+        dirtyBlocks(span);
 }
 
-void RDP::runCommands()
+template <bool update> int RDP::flushBatch(Batch &batch, Span &span)
 {
-    // Start the thread if enabled and not running
-    if (Settings::threadedRdp && !running)
+    // Draw the batched pixels, and update the Z buffer for the ones that were drawn
+    int drawn = (*batchFunc)(batch, span.colorLine), count = 0;
+    for (int i = 0; i < batch.count; i++)
     {
-        running = true;
-        thread = new std::thread(runThreaded);
+        if (!(drawn & (1 << i))) continue;
+        if (update)
+            writeBuffer<uint16_t>(&span.zLine[batch.x[i] * 2], batch.z[i]);
+        count++;
     }
+    batch.count = 0;
+    return count;
+}
 
-    mutex.lock();
+#ifdef __SSE2__
 
-    // Process RDP commands until the end address is reached
-    while (startAddr < endAddr)
-    {
-        // Add a parameter to the buffer
-        opcode.push_back(Memory::read<uint64_t>(addrBase + (startAddr & addrMask)));
-        paramCount++;
+inline __m128i RDP::div255(__m128i value)
+{
+    // Divide 16-bit lanes by 0xFF, exact for products of two 8-bit values
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(value, _mm_set1_epi16(1)), _mm_srli_epi16(value, 8));
+    return _mm_srli_epi16(sum, 8);
+}
 
-        // Execute a command once all of its parameters have been received
-        // When threaded, only run sync commands here; the rest will run on the thread
-        uint8_t op = (opcode[opcode.size() - paramCount] >> 56) & 0x3F;
-        if (paramCount >= paramCounts[op])
-        {
-            paramCount = 0;
-            if (!running || op == 0x29) // Sync Full
-            {
-                mutex.unlock();
-                finishThread();
-                mutex.lock();
-                (*commands[op])();
-                opcode.clear();
-            }
-        }
+inline __m128i RDP::alphaLanes(__m128i colors)
+{
+    // Mirror the alpha of each RGBA32 color to all of its components
+    __m128i alpha = _mm_and_si128(colors, _mm_set1_epi32(0xFF));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+    return _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+}
 
-        // Move to the next parameter
-        startAddr += 8;
-    }
+inline __m128i RDP::inputLanes(uint32_t *input, __m128i texel, __m128i shade)
+{
+    // Get a combiner input for each pixel, using the batched values for inputs that vary per pixel
+    if (input == &texelColor) return texel;
+    if (input == &shadeColor) return shade;
+    if (input == &texelAlpha) return alphaLanes(texel);
+    if (input == &shadeAlpha) return alphaLanes(shade);
+    return _mm_set1_epi32(*input);
+}
 
-    mutex.unlock();
+inline __m128i RDP::combineLanes(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    // Combine 16-bit channels using the formula (A - B) * C + D, wrapping to 8 bits like the scalar path
+    __m128i mask = _mm_set1_epi16(0xFF);
+    __m128i value = _mm_mullo_epi16(_mm_and_si128(_mm_sub_epi16(a, b), mask), c);
+    return _mm_and_si128(_mm_add_epi16(div255(value), d), mask);
 }
 
-void RDP::triangle()
+template <bool rgba16, int mode> int RDP::drawBatch(Batch &batch, uint8_t *line)
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Merge the RGB and alpha inputs of the first combiner cycle for each pixel
+    __m128i texel = _mm_loadu_si128((__m128i*)batch.texel);
+    __m128i shade = _mm_loadu_si128((__m128i*)batch.shade);
+    __m128i alphaMask = _mm_set1_epi32(0xFF);
+    uint32_t **inputs[4] = { combineA, combineB, combineC, combineD };
+    __m128i lo[4], hi[4];
+    for (int i = 0; i < 4; i++)
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        __m128i rgb = inputLanes(inputs[i][0], texel, shade);
+        __m128i alpha = inputLanes(inputs[i][2], texel, shade);
+        __m128i input = _mm_or_si128(_mm_andnot_si128(alphaMask, rgb), _mm_and_si128(alphaMask, alpha));
+        lo[i] = _mm_unpacklo_epi8(input, _mm_setzero_si128());
+        hi[i] = _mm_unpackhi_epi8(input, _mm_setzero_si128());
+    }
 
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
-        {
-            // Draw pixels if they're within scissor bounds
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2)
-                drawPixel(x, y);
+    // Combine the channels of 4 pixels at once
+    __m128i combLo = combineLanes(lo[0], lo[1], lo[2], lo[3]);
+    __m128i combHi = combineLanes(hi[0], hi[1], hi[2], hi[3]);
+    __m128i result = _mm_packus_epi16(combLo, combHi);
+
+    if (mode == BLEND_ALPHA)
+    {
+        // Read the previous pixels from the color buffer
+        uint32_t mem[4];
+        for (int i = 0; i < batch.count; i++)
+        {
+            if (rgba16)
+                mem[i] = Pixel::rgba16To32(readBuffer<uint16_t>(&line[batch.x[i] * 2]));
+            else
+                mem[i] = readBuffer<uint32_t>(&line[batch.x[i] * 4]);
+        }
+
+        // Blend the combined and previous colors by alpha; the scales always sum to 0xFF, so this is exact
+        __m128i memory = _mm_loadu_si128((__m128i*)mem);
+        __m128i scale = alphaLanes(result);
+        __m128i scaleLo = _mm_unpacklo_epi8(scale, _mm_setzero_si128());
+        __m128i scaleHi = _mm_unpackhi_epi8(scale, _mm_setzero_si128());
+        __m128i inverse = _mm_set1_epi16(0xFF);
+        __m128i blendLo = _mm_add_epi16(_mm_mullo_epi16(combLo, scaleLo),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(memory, _mm_setzero_si128()), _mm_sub_epi16(inverse, scaleLo)));
+        __m128i blendHi = _mm_add_epi16(_mm_mullo_epi16(combHi, scaleHi),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(memory, _mm_setzero_si128()), _mm_sub_epi16(inverse, scaleHi)));
+        _mm_storeu_si128((__m128i*)mem, _mm_packus_epi16(div255(blendLo), div255(blendHi)));
+
+        // Write the blended pixels, keeping the last values in state like the scalar path
+        uint32_t comb[4];
+        _mm_storeu_si128((__m128i*)comb, result);
+        int drawn = 0;
+        for (int i = 0; i < batch.count; i++)
+        {
+            combColor = comb[i];
+            pixelAlpha = combAlpha = colorToAlpha(combColor);
+            if (alphaMultiply && !pixelAlpha)
+                continue;
+
+            memColor = mem[i] & ~0xFF;
+            if (rgba16)
+                writeBuffer<uint16_t>(&line[batch.x[i] * 2], Pixel::rgba32To16(memColor | 0xFF));
+            else
+                writeBuffer<uint32_t>(&line[batch.x[i] * 4], memColor | 0xFF);
+            drawn |= 1 << i;
+        }
+        return drawn;
+    }
+    else
+    {
+        // Write the combined pixels directly, since the opaque blender passes them through
+        uint32_t comb[4];
+        _mm_storeu_si128((__m128i*)comb, result);
+        int drawn = 0;
+        for (int i = 0; i < batch.count; i++)
+        {
+            combColor = comb[i];
+            pixelAlpha = combAlpha = colorToAlpha(combColor);
+            if (alphaMultiply && !pixelAlpha)
+                continue;
+
+            memColor = combColor & ~0xFF;
+            if (rgba16)
+                writeBuffer<uint16_t>(&line[batch.x[i] * 2], Pixel::rgba32To16(memColor | 0xFF));
+            else
+                writeBuffer<uint32_t>(&line[batch.x[i] * 4], memColor | 0xFF);
+            drawn |= 1 << i;
         }
+        return drawn;
     }
 }
 
-void RDP::triDepth()
+#endif // __SSE2__
+
+template <bool compare, bool update> void RDP::setDepthSpans()
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle depth and gradients
-    int32_t z1 = (opcode[4] >> 32);
-    int32_t dzdx = (opcode[4] >> 0);
-    int32_t dzde = (opcode[5] >> 32);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Select span functions for triangles with depth, specialized for the depth compare and update settings
+    spanFuncs[1] = drawSpan<false, false, true, compare, update>;
+    spanFuncs[3] = drawSpan<false, true,  true, compare, update>;
+    spanFuncs[5] = drawSpan<true,  false, true, compare, update>;
+    spanFuncs[7] = drawSpan<true,  true,  true, compare, update>;
+}
+
+template <int format> void RDP::setSampler(Tile &tile, bool filter, bool cached)
+{
+    // Select a sampler for a format, starting with one that builds the decoded texels if cached
+    if (cached)
+        tile.sampler = filter ? buildTexels<format, true> : buildTexels<format, false>;
+    else
+        tile.sampler = filter ? getTexel<format, true, false> : getTexel<format, false, false>;
+}
+
+void RDP::updateSampler(Tile &tile)
+{
+    // Get the size of the area a tile wraps around, doubled in directions it mirrors
+    int cols = (tile.sMask + 1) << (tile.sMirror && !tile.sClamp);
+    int rows = (tile.tMask + 1) << (tile.tMirror && !tile.tClamp);
+
+    // Cache decoded texels if the area fits, with masks for wrapping within it
+    // Tiles that don't wrap, or wrap around large areas, are decoded from TMEM per texel instead
+    bool cached = ((uint64_t)cols * rows <= 0x4000);
+    tile.cached = cached;
+    if (cached)
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        tile.sWrap = cols - 1;
+        tile.tWrap = rows - 1;
+        for (tile.shift = 0; (1 << tile.shift) < cols; tile.shift++);
+    }
 
-        // Get the interpolated values at the start of the line
-        int32_t za = (z1 += dzde);
+    // Select a sampler specialized for the tile's format and the current filter setting
+    // Unknown formats fall back to a generic sampler that checks the format per texel
+    bool filter = Settings::texFilter && texFilter && cycleType < COPY_MODE;
+    switch (tile.format)
+    {
+        case RGBA16: return setSampler<RGBA16>(tile, filter, cached);
+        case RGBA32: return setSampler<RGBA32>(tile, filter, cached);
+        case CI4:    return setSampler<CI4>(tile, filter, cached);
+        case CI8:    return setSampler<CI8>(tile, filter, cached);
+        case IA4:    return setSampler<IA4>(tile, filter, cached);
+        case IA8:    return setSampler<IA8>(tile, filter, cached);
+        case IA16:   return setSampler<IA16>(tile, filter, cached);
+        case I4:     return setSampler<I4>(tile, filter, cached);
+        case I8:     return setSampler<I8>(tile, filter, cached);
+        default:     return setSampler<-1>(tile, filter, cached);
+    }
+}
 
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
-        {
-            // Get the current pixel's depth value
-            uint16_t z = za >> 16;
+void RDP::invalidateTexels()
+{
+    // Reset the samplers of every tile so decoded texels are rebuilt from the new TMEM contents
+    for (int i = 0; i < 8; i++)
+        updateSampler(tiles[i]);
+}
+
+void RDP::updatePipeline()
+{
+    // Select span functions for the current depth settings
+    if (zCompare)
+        zUpdate ? setDepthSpans<true, true>() : setDepthSpans<true, false>();
+    else
+        zUpdate ? setDepthSpans<false, true>() : setDepthSpans<false, false>();
+
+    // Copy and fill modes only need to be specialized for the color format
+    // Batching is only used when a kernel below is selected, with single pixels as the fallback
+    bool rgba16 = (colorFormat == RGBA16);
+    batchFunc = nullptr;
+    switch (cycleType)
+    {
+        case COPY_MODE:
+            pixelFunc = rgba16 ? drawPixel<COPY_MODE, true, BLEND_GENERIC, BLEND_GENERIC> :
+                drawPixel<COPY_MODE, false, BLEND_GENERIC, BLEND_GENERIC>;
+            return;
+
+        case FILL_MODE:
+            pixelFunc = rgba16 ? drawPixel<FILL_MODE, true, BLEND_GENERIC, BLEND_GENERIC> :
+                drawPixel<FILL_MODE, false, BLEND_GENERIC, BLEND_GENERIC>;
+            return;
 
-            // Draw a pixel if within scissor bounds and the depth test passes
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2 &&
-                (!zCompare || testDepth(x, y, z)))
+        default:
+        {
+            // Look up a pixel function using the blender mode of each cycle, with generic blending as a fallback
+            int modes[2];
+            for (int i = 0; i < 2; i++)
             {
-                // Update the Z buffer if a pixel is drawn
-                if (drawPixel(x, y) && zUpdate)
-                    Memory::write<uint16_t>(zAddress + (y * colorWidth + x) * 2, z);
+                int mode = (blendA[i] << 6) | (blendB[i] << 4) | (blendC[i] << 2) | blendD[i];
+                modes[i] = (mode == BLEND_OPAQUE) ? 1 : (mode == BLEND_ALPHA) ? 2 : 0;
             }
+            pixelFunc = pixelFuncs[cycleType][rgba16][modes[0]][modes[1]];
 
-            // Interpolate the values across the line
-            za += dzdx * inc;
+#ifdef __SSE2__
+            // Use a batch function for one-cycle spans when there's one for the blender mode
+            if (cycleType == ONE_CYCLE && modes[0] && batchable())
+            {
+                if (modes[0] == 1)
+                    batchFunc = rgba16 ? drawBatch<true, BLEND_OPAQUE> : drawBatch<false, BLEND_OPAQUE>;
+                else
+                    batchFunc = rgba16 ? drawBatch<true, BLEND_ALPHA> : drawBatch<false, BLEND_ALPHA>;
+            }
+#endif
+            return;
         }
     }
 }
 
-void RDP::triTexture()
+bool RDP::batchable()
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle texture coordinates and gradients
-    Tile &tile = tiles[(opcode[0] >> 48) & 0x7];
-    int32_t s1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t t1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t w1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t dsdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dtdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dwdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dsde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dtde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dwde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-
-    // Draw a triangle from top to bottom
-    // This differs slightly from others as a hack for sodium64's renderer
-    for (int y = y1; y < y3; y++)
+    // Check if the first combiner cycle is free of inputs that carry over from the previous pixel
+    for (int i = 0; i < 4; i += 2)
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        uint32_t *inputs[4] = { combineA[i], combineB[i], combineC[i], combineD[i] };
+        for (int j = 0; j < 4; j++)
+            if (inputs[j] == &combColor || inputs[j] == &combAlpha)
+                return false;
+    }
+    return true;
+}
 
-        // Get the interpolated values at the start of the line
-        int32_t sa = s1; s1 += dsde;
-        int32_t ta = t1; t1 += dtde;
-        int32_t wa = w1; w1 += dwde;
+void RDP::finishThread()
+{
+    // Stop the thread if it was running, letting it finish queued commands first
+    if (running)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            running = false;
+            condVar.notify_one();
+        }
+
+        thread->join();
+        delete thread;
+        waitIdle();
+    }
+}
+
+void RDP::waitAddress(uint32_t address)
+{
+    // Wait for the thread if it might be drawing to a color or Z buffer containing the address
+    if ((address >= colorStart && address < colorEnd) || (address >= zStart && address < zEnd))
+        waitIdle();
+}
+
+void RDP::waitRange(uint32_t address, uint32_t size)
+{
+    // Wait for the thread if it might be drawing to a color or Z buffer overlapping the range
+    if ((address < colorEnd && address + size > colorStart) || (address < zEnd && address + size > zStart))
+        waitIdle();
+}
 
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x < xb) : (x > xb); x += inc)
+void RDP::startCapture(std::string path, int frames)
+{
+    // Request a capture of the RDP commands and data for some frames, starting after the next Sync Full
+    std::lock_guard<std::mutex> guard(captureMutex);
+    capturePath = path;
+    captureRequest.store(frames);
+}
+
+bool RDP::replayCapture(const std::vector<uint8_t> &data, uint64_t &hash, uint64_t &expected, uint64_t &pixels)
+{
+    // Check the capture header, and match the RAM size and settings the frame was captured with
+    uint32_t header[4];
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(header, &data[0], sizeof(header));
+    if (memcmp(header, "RDPC", 4) || header[1] != 1 || header[2] > sizeof(Memory::rdram))
+        return false;
+    Memory::ramSize = header[2];
+    Settings::texFilter = header[3];
+
+    // Start from a clean RDP, since the capture restores the state it needs
+    reset();
+    std::vector<CaptureRange> buffers;
+    uint64_t words[22];
+    pixelCount = 0;
+    expected = 0;
+
+    // Replay each record in the capture, stopping at the end of the frame
+    for (size_t i = sizeof(header); i + 4 <= data.size();)
+    {
+        uint32_t type, values[7];
+        memcpy(&type, &data[i], 4);
+        i += 4;
+
+        switch (type)
         {
-            // Draw a pixel if it's within scissor bounds
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2)
+            case CAPTURE_COMMAND:
             {
-                // Update the texel color for the current pixel, with perspective correction
-                if (wa >> 15)
-                {
-                    texelColor = getTexel(tile, sa / (wa >> 15), ta / (wa >> 15));
-                    texelAlpha = colorToAlpha(texelColor);
-                }
+                // Execute a command directly, skipping Sync Full since nothing is waiting for interrupts
+                if (i + 4 > data.size())
+                    return false;
+                memcpy(values, &data[i], 4);
+                if (values[0] < 1 || values[0] > 22 || i + 4 + values[0] * 8 > data.size())
+                    return false;
+                memcpy(words, &data[i + 4], values[0] * 8);
+                i += 4 + values[0] * 8;
+
+                // Reject commands without exactly the words they need, so nothing uninitialized is used
+                uint8_t op = (words[0] >> 56) & 0x3F;
+                if (values[0] != paramCounts[op])
+                    return false;
+                Primitive prim;
+                decodeCommand(op, words, prim);
+                opcode = words;
+                primitive = &prim;
+                executeCommand(op, op != 0x29);
+                break;
+            }
 
-                drawPixel(x, y);
+            case CAPTURE_MEMORY:
+            case CAPTURE_BUFFER:
+            {
+                // Restore a block of RDRAM, remembering buffers so they can be hashed at the end
+                if (i + 8 > data.size())
+                    return false;
+                memcpy(values, &data[i], 8);
+                if (i + 8 + values[1] > data.size() || values[0] > Memory::ramSize || values[1] > Memory::ramSize - values[0])
+                    return false;
+                memcpy(&Memory::rdram[values[0]], &data[i + 8], values[1]);
+                Memory::markWritten(values[0], values[1]);
+                if (type == CAPTURE_BUFFER)
+                    buffers.push_back({ values[0], values[1], 0 });
+                i += 8 + values[1];
+                break;
             }
 
-            // Interpolate the values across the line
-            sa += dsdx * inc;
-            ta += dtdx * inc;
-            wa += dwdx * inc;
+            case CAPTURE_TMEM:
+                // Restore the contents of TMEM
+                if (i + sizeof(tmem) > data.size())
+                    return false;
+                memcpy(tmem, &data[i], sizeof(tmem));
+                invalidateTexels();
+                i += sizeof(tmem);
+                break;
+
+            case CAPTURE_STATE:
+                // Restore values that carry over between primitives
+                if (i + sizeof(values) > data.size())
+                    return false;
+                memcpy(values, &data[i], sizeof(values));
+                texelColor = values[0];
+                texelAlpha = values[1];
+                combColor = values[2];
+                combAlpha = values[3];
+                shadeColor = values[4];
+                shadeAlpha = values[5];
+                pixelAlpha = values[6];
+                i += sizeof(values);
+                break;
+
+            case CAPTURE_END:
+                // Hash the buffers the frame drew to, and get the hash from when it was captured
+                if (i + 8 > data.size())
+                    return false;
+                memcpy(&expected, &data[i], 8);
+                hash = hashBuffers(buffers);
+                pixels = pixelCount;
+                return true;
+
+            default:
+                return false;
         }
     }
+    return false;
 }
 
-void RDP::triDepthTex()
+void RDP::finishFrame()
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle texture coordinates and gradients
-    Tile &tile = tiles[(opcode[0] >> 48) & 0x7];
-    int32_t s1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t t1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t w1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t dsdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dtdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dwdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dsde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dtde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dwde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-
-    // Get the base triangle depth and gradients
-    int32_t z1 = (opcode[12] >> 32);
-    int32_t dzdx = (opcode[12] >> 0);
-    int32_t dzde = (opcode[13] >> 32);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Keep the statistics for the frame that just finished, and start counting a new one
+    // This shares the short lock around adding a command, so it never waits for a command to run
+    std::lock_guard<std::mutex> guard(statsMutex);
+    frameStats = stats;
+    memset(&stats, 0, sizeof(stats));
+}
+
+RDP::Stats RDP::getStats()
+{
+    // Get the statistics for the last finished frame
+    std::lock_guard<std::mutex> guard(statsMutex);
+    return frameStats;
+}
+
+std::string RDP::statsString()
+{
+    // Shorten large counts with a suffix so the string fits in a title bar
+    Stats s = getStats();
+    auto count = [](uint64_t value) -> std::string
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        char buffer[16];
+        if (value >= 1000000)
+            snprintf(buffer, sizeof(buffer), "%.1fM", value / 1000000.0);
+        else if (value >= 1000)
+            snprintf(buffer, sizeof(buffer), "%.1fK", value / 1000.0);
+        else
+            snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)value);
+        return buffer;
+    };
+
+    // Summarize the frame, with time split by command class to show where it went
+    uint64_t triangles = 0, rectangles = s.commands[0x24] + s.commands[0x25] + s.commands[0x36];
+    for (int i = 0x08; i <= 0x0F; i++)
+        triangles += s.commands[i];
+    double total = s.times[STAT_TRIANGLE] + s.times[STAT_RECTANGLE] + s.times[STAT_LOAD] + s.times[STAT_STATE];
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "RDP %.2f ms (tri %.2f, rect %.2f, load %.2f, state %.2f) | %s tris, %s rects | "
+        "%s px, %s drawn, %s Z rejected | %s texels, %sB TMEM", total * 1000, s.times[STAT_TRIANGLE] * 1000,
+        s.times[STAT_RECTANGLE] * 1000, s.times[STAT_LOAD] * 1000, s.times[STAT_STATE] * 1000,
+        count(triangles).c_str(), count(rectangles).c_str(), count(s.pixelsTested).c_str(),
+        count(s.pixelsDrawn).c_str(), count(s.depthRejects).c_str(), count(s.texelsFetched).c_str(),
+        count(s.tmemBytes).c_str());
+    return buffer;
+}
 
-        // Get the interpolated values at the start of the line
-        int32_t sa = (s1 += dsde);
-        int32_t ta = (t1 += dtde);
-        int32_t wa = (w1 += dwde);
-        int32_t za = (z1 += dzde);
+bool RDP::dumpStats(std::string path)
+{
+    // Try to open the output file
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    Stats s = getStats();
+
+    // Write the counters for the last finished frame as JSON, listing only opcodes that were used
+    fprintf(file, "{\n  \"commands\": {");
+    for (int i = 0, first = 1; i < 0x40; i++)
+    {
+        if (!s.commands[i]) continue;
+        fprintf(file, "%s\n    \"0x%02X\": %llu", first ? "" : ",", i, (unsigned long long)s.commands[i]);
+        first = 0;
+    }
+    fprintf(file, "\n  },\n  \"primitives\": { \"oneCycle\": %llu, \"twoCycle\": %llu, \"copy\": %llu, \"fill\": %llu },\n",
+        (unsigned long long)s.primitives[ONE_CYCLE], (unsigned long long)s.primitives[TWO_CYCLE],
+        (unsigned long long)s.primitives[COPY_MODE], (unsigned long long)s.primitives[FILL_MODE]);
+    fprintf(file, "  \"pixelsTested\": %llu,\n  \"pixelsDrawn\": %llu,\n  \"depthRejects\": %llu,\n",
+        (unsigned long long)s.pixelsTested, (unsigned long long)s.pixelsDrawn, (unsigned long long)s.depthRejects);
+    fprintf(file, "  \"texelsFetched\": %llu,\n  \"tmemBytes\": %llu,\n  \"uploadsSkipped\": %llu,\n",
+        (unsigned long long)s.texelsFetched, (unsigned long long)s.tmemBytes, (unsigned long long)s.uploadsSkipped);
+    fprintf(file, "  \"times\": { \"triangle\": %.6f, \"rectangle\": %.6f, \"load\": %.6f, \"state\": %.6f }\n}\n",
+        s.times[STAT_TRIANGLE], s.times[STAT_RECTANGLE], s.times[STAT_LOAD], s.times[STAT_STATE]);
+    fclose(file);
+    return true;
+}
 
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
-        {
-            // Get the current pixel's depth value
-            uint16_t z = za >> 16;
+void RDP::captureData(const void *data, uint32_t size)
+{
+    // Append raw data to the capture
+    const uint8_t *bytes = (const uint8_t*)data;
+    capture.insert(capture.end(), bytes, bytes + size);
+}
 
-            // Draw a pixel if within scissor bounds and the depth test passes
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2 &&
-                (!zCompare || testDepth(x, y, z)))
-            {
-                // Update the texel color for the current pixel, with perspective correction
-                if (wa >> 15)
-                {
-                    texelColor = getTexel(tile, sa / (wa >> 15), ta / (wa >> 15));
-                    texelAlpha = colorToAlpha(texelColor);
-                }
+void RDP::captureMemory(CaptureRecord type, uint32_t address, uint32_t size)
+{
+    // Clip the range to RDRAM, and skip it if it was already captured and hasn't been written since
+    // Buffers only need their contents from the start of the frame, so they're captured once
+    address = std::min(address & 0x1FFFFFFF, Memory::ramSize);
+    size = std::min(size, Memory::ramSize - address);
+    std::vector<CaptureRange> &ranges = (type == CAPTURE_BUFFER) ? captureBuffers : captureRanges;
+    if (type != CAPTURE_BUFFER)
+        Memory::watchWrites();
+    uint32_t writes = (type == CAPTURE_BUFFER) ? 0 : Memory::countWrites(address, size);
+    for (size_t i = 0; i < ranges.size(); i++)
+        if (ranges[i].address == address && ranges[i].size == size && ranges[i].writes == writes)
+            return;
+    if (!size) return;
+    ranges.push_back({ address, size, writes });
+
+    // Add a record with the current contents of the range, placed before the command that's using it
+    // This way the memory is restored before the command runs during replay
+    uint32_t values[3] = { (uint32_t)type, address, size };
+    capture.insert(capture.begin() + captureStart, &Memory::rdram[address], &Memory::rdram[address + size]);
+    capture.insert(capture.begin() + captureStart, (uint8_t*)values, (uint8_t*)(values + 3));
+    captureStart += sizeof(values) + size;
+}
 
-                // Update the Z buffer if a pixel is drawn
-                if (drawPixel(x, y) && zUpdate)
-                    Memory::write<uint16_t>(zAddress + (y * colorWidth + x) * 2, z);
-            }
+uint64_t RDP::hashBuffers(std::vector<CaptureRange> &buffers)
+{
+    // Hash the contents of captured color and Z buffers
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < buffers.size(); i++)
+        for (uint32_t j = 0; j < buffers[i].size; j++)
+            hash = (hash ^ Memory::rdram[buffers[i].address + j]) * 0x100000001B3;
+    return hash;
+}
 
-            // Interpolate the values across the line
-            sa += dsdx * inc;
-            ta += dtdx * inc;
-            wa += dwdx * inc;
-            za += dzdx * inc;
-        }
+void RDP::beginCapture()
+{
+    // Start a capture with a header, and reset the tracked ranges
+    uint32_t header[4] = { 0, 1, Memory::ramSize, (uint32_t)Settings::texFilter };
+    memcpy(header, "RDPC", 4);
+    capture.clear();
+    captureRanges.clear();
+    captureBuffers.clear();
+    captureData(header, sizeof(header));
+    capturing = true;
+
+    // Recreate the current state with commands, so the frame doesn't depend on earlier ones
+    std::vector<uint64_t> state =
+    {
+        (0x3FULL << 56) | ((uint64_t)colorFormat << 51) | ((uint64_t)(colorWidth - 1) << 32) | (colorAddress & 0xFFFFFF),
+        (0x3EULL << 56) | (zAddress & 0xFFFFFF),
+        (0x3DULL << 56) | ((uint64_t)texFormat << 51) | ((uint64_t)(texWidth - 1) << 32) | (texAddress & 0xFFFFFF),
+        (0x2DULL << 56) | ((uint64_t)scissorX1 << 46) | ((uint64_t)scissorY1 << 34) | (scissorX2 << 14) | (scissorY2 << 2),
+        otherModes, combineMode,
+        (0x37ULL << 56) | fillColor, (0x38ULL << 56) | fogColor, (0x39ULL << 56) | blendColor,
+        (0x3AULL << 56) | primColor, (0x3BULL << 56) | envColor
+    };
+    for (int i = 0; i < 8; i++)
+    {
+        state.push_back(tiles[i].command);
+        state.push_back((0x32ULL << 56) | ((uint64_t)(tiles[i].sBase >> 3) << 44) |
+            ((uint64_t)(tiles[i].tBase >> 3) << 32) | ((uint64_t)i << 24));
     }
+    for (size_t i = 0; i < state.size(); i++)
+    {
+        // Skip commands for state that was never set
+        if (!state[i]) continue;
+        uint32_t values[2] = { CAPTURE_COMMAND, 1 };
+        captureData(values, sizeof(values));
+        captureData(&state[i], 8);
+    }
+
+    // Capture TMEM and values that carry over between primitives
+    uint32_t values[8] = { CAPTURE_STATE, texelColor, texelAlpha, combColor, combAlpha, shadeColor, shadeAlpha, pixelAlpha };
+    uint32_t type = CAPTURE_TMEM;
+    captureData(&type, 4);
+    captureData(tmem, sizeof(tmem));
+    captureData(values, sizeof(values));
 }
 
-void RDP::triShade()
+void RDP::endCapture()
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle color components and gradients
-    int32_t r1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t g1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t b1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t a1 = (((opcode[4] >>  0) & 0xFFFF) << 16) | ((opcode[6] >>  0) & 0xFFFF);
-    int32_t drdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dgdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dbdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dadx = (((opcode[5] >>  0) & 0xFFFF) << 16) | ((opcode[7] >>  0) & 0xFFFF);
-    int32_t drde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dgde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dbde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-    int32_t dade = (((opcode[8] >>  0) & 0xFFFF) << 16) | ((opcode[10] >>  0) & 0xFFFF);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Finish the capture with a hash of the buffers the frame drew to
+    uint32_t type = CAPTURE_END;
+    uint64_t hash = hashBuffers(captureBuffers);
+    captureData(&type, 4);
+    captureData(&hash, 8);
+    capturing = false;
+
+    // Write the capture to a numbered file
+    char name[16];
+    sprintf(name, "_%03d.rdp", captureIndex++);
+    std::string path;
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        std::lock_guard<std::mutex> guard(captureMutex);
+        path = capturePath + name;
+    }
+    if (FILE *file = fopen(path.c_str(), "wb"))
+    {
+        fwrite(&capture[0], sizeof(uint8_t), capture.size(), file);
+        fclose(file);
+    }
+    else
+    {
+        LOG_WARN("Failed to write RDP capture: %s\n", path.c_str());
+    }
+    capture.clear();
+}
 
-        // Get the interpolated values at the start of the line
-        int32_t ra = (r1 += drde);
-        int32_t ga = (g1 += dgde);
-        int32_t ba = (b1 += dbde);
-        int32_t aa = (a1 += dade);
+void RDP::captureCommand(uint8_t op)
+{
+    // Record the words of a command
+    if (op != 0x29)
+    {
+        uint32_t values[2] = { CAPTURE_COMMAND, paramCounts[op] };
+        captureStart = capture.size();
+        captureData(values, sizeof(values));
+        captureData(opcode, paramCounts[op] * 8);
+        return;
+    }
+
+    // Treat Sync Full as the end of a frame, finishing a capture or starting a requested one
+    if (capturing)
+        endCapture();
+    if (captureRequest.load() > 0)
+    {
+        captureRequest.fetch_sub(1);
+        beginCapture();
+    }
+}
+
+void RDP::waitIdle()
+{
+    {
+        // Wait until the thread has run every queued command, sleeping until it reports progress
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCond.wait(lock, [] { return executed.load() == queued; });
+    }
+
+    // Stop tracking buffers now that nothing is being drawn
+    busy = false;
+    colorStart = zStart = -1;
+    colorEnd = zEnd = 0;
+}
+
+void RDP::syncInterrupt()
+{
+    // Wait for the thread to reach the Sync Full command if it hasn't already
+    uint32_t target = syncs.front();
+    syncs.pop();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCond.wait(lock, [&] { return (int32_t)(executed.load() - target) >= 0; });
+    }
+
+    // Stop tracking buffers if that was the last command, and trigger a DP interrupt
+    if (executed.load() == queued)
+        waitIdle();
+    MI::setInterrupt(5);
+}
+
+void RDP::trackCommand(uint8_t op)
+{
+    // Keep track of state on the queueing side that determines where the thread will draw
+    uint64_t value = params[params.size() - paramCounts[op]];
+    syncWords += paramCounts[op];
+    queued++;
+
+    switch (op)
+    {
+        case 0x29: // Sync Full
+            // Schedule a DP interrupt for the logical completion of the commands
+            // This is a rough estimate of RDP timing, based on words sent since the last sync
+            syncs.push(queued);
+            Core::schedule(syncInterrupt, 1000 + syncWords * 16);
+            syncWords = 0;
+            return;
 
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
+        case 0x2D: // Set Scissor
+            trackScissorX = ((value >> 12) & 0xFFF) >> 2;
+            trackScissorY = ((value >>  0) & 0xFFF) >> 2;
+            return;
+
+        case 0x3E: // Set Z Image
+            trackZAddr = value & 0xFFFFFF;
+            return;
+
+        case 0x3F: // Set Color Image
+            trackColorAddr = value & 0xFFFFFF;
+            trackColorWidth = ((value >> 32) & 0x3FF) + 1;
+            trackColorSize = (((value >> 51) & 0x1F) == RGBA32) ? 4 : 2;
+            return;
+
+        case 0x09: case 0x0B: case 0x0D: case 0x0F: // Depth triangles
+            // Track the part of the Z buffer that can be drawn to within scissor bounds
+            zStart = std::min(zStart, trackZAddr);
+            zEnd = std::max(zEnd, trackZAddr + (trackScissorY * trackColorWidth + trackScissorX) * 2);
+
+        case 0x08: case 0x0A: case 0x0C: case 0x0E: // Triangles
+        case 0x24: case 0x36: // Rectangles
+            // Track the part of the color buffer that can be drawn to within scissor bounds
+            colorStart = std::min(colorStart, trackColorAddr);
+            colorEnd = std::max(colorEnd, trackColorAddr + (trackScissorY * trackColorWidth + trackScissorX) * trackColorSize);
+            busy = true;
+            return;
+    }
+}
+
+bool RDP::redundantState(uint64_t value)
+{
+    // Forget the last state if the filter setting changed, since state commands also reselect samplers
+    if (stateFilter != Settings::texFilter)
+    {
+        memset(stateWords, 0, sizeof(stateWords));
+        memset(tileWords, 0, sizeof(tileWords));
+        memset(tileSizeWords, 0, sizeof(tileSizeWords));
+        stateFilter = Settings::texFilter;
+    }
+
+    // Get the last word of a state command, or remember what other commands change
+    uint64_t *last;
+    switch (uint8_t op = (value >> 56) & 0x3F)
+    {
+        case 0x2D: case 0x2F: // Set Scissor, Set Other Modes
+        case 0x37: case 0x38: case 0x39: case 0x3A: case 0x3B: // Set colors
+        case 0x3C: case 0x3D: case 0x3E: case 0x3F: // Set Combine, Set images
+            last = &stateWords[op];
+            break;
+
+        case 0x32: // Set Tile Size
+            last = &tileSizeWords[(value >> 24) & 0x7];
+            break;
+
+        case 0x35: // Set Tile
+            last = &tileWords[(value >> 24) & 0x7];
+            break;
+
+        case 0x34: // Load Tile
+            // Loading a tile also sets its coordinates, so the next Set Tile Size can't be dropped
+            tileSizeWords[(value >> 24) & 0x7] = 0;
+            return false;
+
+        default:
+            return false;
+    }
+
+    // Drop the command if it sets exactly what the last one did, since it wouldn't change anything
+    // Microcode often sends the same state between primitives, so this saves queueing and applying it
+    if (*last == value)
+        return true;
+    *last = value;
+    return false;
+}
+
+void RDP::executeCommand(uint8_t op, bool run)
+{
+    // Execute a command without any overhead if statistics are disabled
+    if (!Settings::rdpStats)
+    {
+        if (run) (*commands[op])();
+        return;
+    }
+
+    // Remember the counters and mode so the command's share can be added to the frame
+    // The counters only change on this thread, so the command runs without holding the lock
+    uint64_t counts[] = { pixelCount, drawnCount, rejectCount, texelCount, tmemCount, skipCount };
+    CycleType type = cycleType;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Execute the command and measure how long it took
+    if (run) (*commands[op])();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+    // Sort the command into a class
+    StatClass cls = STAT_STATE;
+    if (op >= 0x08 && op <= 0x0F)
+        cls = STAT_TRIANGLE;
+    else if (op == 0x24 || op == 0x25 || op == 0x36)
+        cls = STAT_RECTANGLE;
+    else if (op == 0x30 || op == 0x33 || op == 0x34)
+        cls = STAT_LOAD;
+
+    // Add the command to the statistics for the current frame, counting primitives by the cycle type they were drawn with
+    // Only this is locked, so a frame finishing on another thread can't see a command partly added
+    std::lock_guard<std::mutex> guard(statsMutex);
+    if (cls == STAT_TRIANGLE || cls == STAT_RECTANGLE)
+        stats.primitives[type]++;
+    stats.commands[op]++;
+    stats.times[cls] += time.count();
+    stats.pixelsTested += pixelCount - counts[0];
+    stats.pixelsDrawn += drawnCount - counts[1];
+    stats.depthRejects += rejectCount - counts[2];
+    stats.texelsFetched += texelCount - counts[3];
+    stats.tmemBytes += tmemCount - counts[4];
+    stats.uploadsSkipped += skipCount - counts[5];
+}
+
+DisplayBuffer *RDP::findDisplay(uint32_t address)
+{
+    // Find the display buffer that contains an RDRAM address, if any
+    for (uint32_t i = 0; i < std::min(displayCount, 4U); i++)
+    {
+        if (address - displays[i].address < displays[i].size)
+            return &displays[i];
+    }
+    return nullptr;
+}
+
+void RDP::updateSkipped()
+{
+    // Check if any display buffer holds a skipped frame, so memory reads only look up buffers when needed
+    skipped = false;
+    for (uint32_t i = 0; i < std::min(displayCount, 4U); i++)
+        skipped |= displays[i].stale;
+}
+
+void RDP::readDisplay(uint32_t address)
+{
+    // Stop skipping drawing to a display buffer once the CPU reads from it, since its contents are needed
+    if (DisplayBuffer *display = findDisplay(address & 0xFFFFFF))
+        display->readBack = true;
+}
+
+bool RDP::skipCommand(uint8_t op, uint64_t value)
+{
+    // Track the state that decides if a primitive can be skipped, on the queueing side like other tracking
+    switch (op)
+    {
+        case 0x2F: // Set Other Modes
+            skipZUpdate = (value >> 5) & 0x1;
+            return false;
+
+        case 0x3D: // Set Texture Image
+            // Stop skipping drawing to a display buffer once it gets used as a texture, since its contents are needed
+            // Skipped drawing isn't replayed, so the first texture read can still see contents from an older frame
+            if (DisplayBuffer *display = findDisplay(value & 0xFFFFFF))
+                display->readBack = true;
+            return false;
+
+        case 0x3F: // Set Color Image
         {
-            // Draw a pixel if it's within scissor bounds
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2)
-            {
-                // Update the shade color for the current pixel
-                uint8_t r = std::max(0x00, std::min(0xFF, ra >> 16));
-                uint8_t g = std::max(0x00, std::min(0xFF, ga >> 16));
-                uint8_t b = std::max(0x00, std::min(0xFF, ba >> 16));
-                uint8_t a = std::max(0x00, std::min(0xFF, aa >> 16));
-                shadeColor = (r << 24) | (g << 16) | (b << 8) | a;
-                shadeAlpha = colorToAlpha(shadeColor);
+            // Start a new frame when drawing moves to a different display buffer
+            skipColorAddr = value & 0xFFFFFF;
+            DisplayBuffer *display = findDisplay(skipColorAddr);
+            if (!display || display == drawDisplay)
+                return false;
+            drawDisplay = display;
 
-                drawPixel(x, y);
-            }
+            // Skip frames at the ratio set by the governor, marking their buffers so the VI won't show them
+            skipping = Settings::frameSkip && skipRatio && (++skipFrames % (skipRatio + 1));
+            display->stale = skipping && !display->readBack;
+            updateSkipped();
+            return false;
+        }
 
-            // Interpolate the values across the line
-            ra += drdx * inc;
-            ga += dgdx * inc;
-            ba += dbdx * inc;
-            aa += dadx * inc;
+        case 0x09: case 0x0B: case 0x0D: case 0x0F: // Depth triangles
+            // Always draw triangles that update the Z buffer, since the CPU might read it back
+            if (skipZUpdate)
+                return false;
+
+        case 0x08: case 0x0A: case 0x0C: case 0x0E: // Triangles
+        case 0x24: case 0x25: case 0x36: // Rectangles
+        {
+            // Skip primitives that only draw to a display buffer in a skipped frame
+            // Anything drawn elsewhere, like off-screen targets and Z buffers, is still drawn
+            DisplayBuffer *display = findDisplay(skipColorAddr);
+            return skipping && display && display->stale && !display->readBack;
         }
+
+        default:
+            return false;
     }
 }
 
-void RDP::triDepthSha()
+bool RDP::scanOut(uint32_t address, uint32_t size)
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle color components and gradients
-    int32_t r1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t g1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t b1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t a1 = (((opcode[4] >>  0) & 0xFFFF) << 16) | ((opcode[6] >>  0) & 0xFFFF);
-    int32_t drdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dgdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dbdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dadx = (((opcode[5] >>  0) & 0xFFFF) << 16) | ((opcode[7] >>  0) & 0xFFFF);
-    int32_t drde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dgde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dbde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-    int32_t dade = (((opcode[8] >>  0) & 0xFFFF) << 16) | ((opcode[10] >>  0) & 0xFFFF);
-
-    // Get the base triangle depth and gradients
-    int32_t z1 = (opcode[12] >> 32);
-    int32_t dzdx = (opcode[12] >> 0);
-    int32_t dzde = (opcode[13] >> 32);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Remember buffers the VI shows, so drawing to them can be recognized as part of a frame
+    address &= 0xFFFFFF;
+    DisplayBuffer *display = findDisplay(address);
+    if (!display || display->address != address || display->size != size)
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        display = &displays[displayCount++ & 0x3];
+        if (display == drawDisplay) drawDisplay = nullptr;
+        *display = { address, size, false, false };
+        updateSkipped();
+    }
 
-        // Get the interpolated values at the start of the line
-        int32_t ra = (r1 += drde);
-        int32_t ga = (g1 += dgde);
-        int32_t ba = (b1 += dbde);
-        int32_t aa = (a1 += dade);
-        int32_t za = (z1 += dzde);
-
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
+    if (Settings::frameSkip && ++governorFrames == 30)
+    {
+        // Every 30 frames, compare the time they took to the half second they should have taken
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - governorTime;
+        double speed = 0.5 / time.count();
+
+        // Skip more frames when running slow, and fewer after running at full speed for a while
+        if (speed < 0.95)
+        {
+            skipRatio = std::min(skipRatio + 1, 3);
+            governorFast = 0;
+        }
+        else if (speed >= 0.99 && skipRatio && ++governorFast >= 4)
         {
-            // Get the current pixel's Z value
-            uint16_t z = za >> 16;
+            skipRatio--;
+            governorFast = 0;
+        }
+        governorFrames = 0;
+        governorTime = std::chrono::steady_clock::now();
+    }
+    else if (!Settings::frameSkip)
+    {
+        // Start over if frameskip is disabled
+        skipRatio = 0;
+        governorFrames = 0;
+        governorTime = std::chrono::steady_clock::now();
+    }
 
-            // Draw a pixel if within scissor bounds and the depth test passes
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2 &&
-                (!zCompare || testDepth(x, y, z)))
-            {
-                // Update the shade color for the current pixel
-                uint8_t r = std::max(0x00, std::min(0xFF, ra >> 16));
-                uint8_t g = std::max(0x00, std::min(0xFF, ga >> 16));
-                uint8_t b = std::max(0x00, std::min(0xFF, ba >> 16));
-                uint8_t a = std::max(0x00, std::min(0xFF, aa >> 16));
-                shadeColor = (r << 24) | (g << 16) | (b << 8) | a;
-                shadeAlpha = colorToAlpha(shadeColor);
+    // Report whether the buffer is complete and can be shown
+    return !display->stale;
+}
 
-                // Update the Z buffer if a pixel is drawn
-                if (drawPixel(x, y) && zUpdate)
-                    Memory::write<uint16_t>(zAddress + (y * colorWidth + x) * 2, z);
-            }
+bool RDP::isPrimitive(uint8_t op)
+{
+    // Check if a command is a triangle or rectangle with a decoded form
+    return (op >= 0x08 && op <= 0x0F) || op == 0x24 || op == 0x36;
+}
+
+void RDP::decodeTriangle(const uint64_t *words, TriangleCommand &tri)
+{
+    // Decode the base triangle parameters
+    tri = {};
+    tri.y1 = (int16_t)(words[0] <<  2) >> 4; // High Y-coord
+    tri.y2 = (int16_t)(words[0] >> 14) >> 4; // Middle Y-coord
+    tri.y3 = (int16_t)(words[0] >> 30) >> 4; // Low Y-coord
+    tri.slope1 = words[1]; // Low edge slope
+    tri.slope2 = words[2]; // High edge slope
+    tri.slope3 = words[3]; // Middle edge slope
+    tri.x1 = (words[1] >> 32) - tri.slope1; // Low edge X-coord
+    tri.x2 = (words[2] >> 32); // High edge X-coord
+    tri.x3 = (words[3] >> 32); // Middle edge X-coord
+    tri.orient = (words[0] >> 55) & 0x1;
+    tri.tile = (words[0] >> 48) & 0x7;
+
+    // Gradients across lines are flipped to match the direction lines are drawn
+    int32_t inc = (tri.orient ? 1 : -1);
+    const uint64_t *params = &words[4];
+    uint8_t op = (words[0] >> 56) & 0x3F;
+
+    if (op & 0x4)
+    {
+        // Get the base triangle color components and gradients
+        tri.r = (((params[0] >> 48) & 0xFFFF) << 16) | ((params[2] >> 48) & 0xFFFF);
+        tri.g = (((params[0] >> 32) & 0xFFFF) << 16) | ((params[2] >> 32) & 0xFFFF);
+        tri.b = (((params[0] >> 16) & 0xFFFF) << 16) | ((params[2] >> 16) & 0xFFFF);
+        tri.a = (((params[0] >>  0) & 0xFFFF) << 16) | ((params[2] >>  0) & 0xFFFF);
+        tri.drdx = (int32_t)((((params[1] >> 48) & 0xFFFF) << 16) | ((params[3] >> 48) & 0xFFFF)) * inc;
+        tri.dgdx = (int32_t)((((params[1] >> 32) & 0xFFFF) << 16) | ((params[3] >> 32) & 0xFFFF)) * inc;
+        tri.dbdx = (int32_t)((((params[1] >> 16) & 0xFFFF) << 16) | ((params[3] >> 16) & 0xFFFF)) * inc;
+        tri.dadx = (int32_t)((((params[1] >>  0) & 0xFFFF) << 16) | ((params[3] >>  0) & 0xFFFF)) * inc;
+        tri.drde = (((params[4] >> 48) & 0xFFFF) << 16) | ((params[6] >> 48) & 0xFFFF);
+        tri.dgde = (((params[4] >> 32) & 0xFFFF) << 16) | ((params[6] >> 32) & 0xFFFF);
+        tri.dbde = (((params[4] >> 16) & 0xFFFF) << 16) | ((params[6] >> 16) & 0xFFFF);
+        tri.dade = (((params[4] >>  0) & 0xFFFF) << 16) | ((params[6] >>  0) & 0xFFFF);
+        params += 8;
+    }
+
+    if (op & 0x2)
+    {
+        // Get the base triangle texture coordinates and gradients
+        tri.s = (((params[0] >> 48) & 0xFFFF) << 16) | ((params[2] >> 48) & 0xFFFF);
+        tri.t = (((params[0] >> 32) & 0xFFFF) << 16) | ((params[2] >> 32) & 0xFFFF);
+        tri.w = (((params[0] >> 16) & 0xFFFF) << 16) | ((params[2] >> 16) & 0xFFFF);
+        tri.dsdx = (int32_t)((((params[1] >> 48) & 0xFFFF) << 16) | ((params[3] >> 48) & 0xFFFF)) * inc;
+        tri.dtdx = (int32_t)((((params[1] >> 32) & 0xFFFF) << 16) | ((params[3] >> 32) & 0xFFFF)) * inc;
+        tri.dwdx = (int32_t)((((params[1] >> 16) & 0xFFFF) << 16) | ((params[3] >> 16) & 0xFFFF)) * inc;
+        tri.dsde = (((params[4] >> 48) & 0xFFFF) << 16) | ((params[6] >> 48) & 0xFFFF);
+        tri.dtde = (((params[4] >> 32) & 0xFFFF) << 16) | ((params[6] >> 32) & 0xFFFF);
+        tri.dwde = (((params[4] >> 16) & 0xFFFF) << 16) | ((params[6] >> 16) & 0xFFFF);
+        params += 8;
+    }
+
+    if (op & 0x1)
+    {
+        // Get the base triangle depth and gradients
+        tri.z = (params[0] >> 32);
+        tri.dzdx = (int32_t)(params[0] >> 0) * inc;
+        tri.dzde = (params[1] >> 32);
+    }
+}
 
-            // Interpolate the values across the line
-            ra += drdx * inc;
-            ga += dgdx * inc;
-            ba += dbdx * inc;
-            aa += dadx * inc;
-            za += dzdx * inc;
+void RDP::decodeRect(const uint64_t *words, RectCommand &rect)
+{
+    // Decode the rectangle bounds, and the texture coordinates if it has them
+    rect.y1 = ((words[0] >>  0) & 0xFFF) >> 2;
+    rect.x1 = ((words[0] >> 12) & 0xFFF) >> 2;
+    rect.tile = (words[0] >> 24) & 0x7;
+    rect.y2 = ((words[0] >> 32) & 0xFFF) >> 2;
+    rect.x2 = ((words[0] >> 44) & 0xFFF) >> 2;
+    bool texture = ((words[0] >> 56) & 0x3F) == 0x24;
+    rect.dtdy = texture ? (int16_t)(words[1] >>  0) : 0;
+    rect.dsdx = texture ? (int16_t)(words[1] >> 16) : 0;
+    rect.t = texture ? (int16_t)(words[1] >> 32) << 5 : 0;
+    rect.s = texture ? (int16_t)(words[1] >> 48) << 5 : 0;
+}
+
+void RDP::decodeCommand(uint8_t op, const uint64_t *words, Primitive &prim)
+{
+    // Extract a primitive's fields once, so they're ready before it reaches the rasterizer
+    if (op >= 0x08 && op <= 0x0F)
+        decodeTriangle(words, prim.triangle);
+    else if (op == 0x24 || op == 0x36)
+        decodeRect(words, prim.rect);
+}
+
+void RDP::runThreaded()
+{
+    uint64_t command[22];
+    Primitive prim;
+
+    while (true)
+    {
+        // Wait until a command has all of its parameters queued
+        std::unique_lock<std::mutex> lock(mutex);
+        uint8_t op = 0;
+        condVar.wait(lock, [&]
+        {
+            op = params.empty() ? 0 : ((params[0] >> 56) & 0x3F);
+            return (!params.empty() && params.size() >= paramCounts[op]) || !running;
+        });
+
+        // If requested, stop running when the queue is empty
+        if (params.empty() || params.size() < paramCounts[op])
+            return;
+
+        // Move the command out of the queue so more can be added while it runs
+        std::copy(params.begin(), params.begin() + paramCounts[op], command);
+        params.erase(params.begin(), params.begin() + paramCounts[op]);
+        if (isPrimitive(op))
+        {
+            // Take the primitive's decoded form, which was queued alongside its words
+            prim = primitives.front();
+            primitives.pop();
         }
+        lock.unlock();
+
+        // Execute the command and mark it as done
+        // Sync Full only needs to be marked, since the scheduler triggers its interrupt
+        opcode = command;
+        primitive = &prim;
+        if (capturing || op == 0x29)
+            captureCommand(op);
+        executeCommand(op, op != 0x29);
+
+        // Count the command under the lock so a waiting emulation thread can't miss the wakeup
+        lock.lock();
+        executed.fetch_add(1);
+        lock.unlock();
+        doneCond.notify_one();
     }
 }
 
-void RDP::triShadeTex()
+void RDP::runCommands()
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle color components and gradients
-    int32_t r1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t g1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t b1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t a1 = (((opcode[4] >>  0) & 0xFFFF) << 16) | ((opcode[6] >>  0) & 0xFFFF);
-    int32_t drdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dgdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dbdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dadx = (((opcode[5] >>  0) & 0xFFFF) << 16) | ((opcode[7] >>  0) & 0xFFFF);
-    int32_t drde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dgde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dbde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-    int32_t dade = (((opcode[8] >>  0) & 0xFFFF) << 16) | ((opcode[10] >>  0) & 0xFFFF);
-
-    // Get the base triangle texture coordinates and gradients
-    Tile &tile = tiles[(opcode[0] >> 48) & 0x7];
-    int32_t s1 = (((opcode[12] >> 48) & 0xFFFF) << 16) | ((opcode[14] >> 48) & 0xFFFF);
-    int32_t t1 = (((opcode[12] >> 32) & 0xFFFF) << 16) | ((opcode[14] >> 32) & 0xFFFF);
-    int32_t w1 = (((opcode[12] >> 16) & 0xFFFF) << 16) | ((opcode[14] >> 16) & 0xFFFF);
-    int32_t dsdx = (((opcode[13] >> 48) & 0xFFFF) << 16) | ((opcode[15] >> 48) & 0xFFFF);
-    int32_t dtdx = (((opcode[13] >> 32) & 0xFFFF) << 16) | ((opcode[15] >> 32) & 0xFFFF);
-    int32_t dwdx = (((opcode[13] >> 16) & 0xFFFF) << 16) | ((opcode[15] >> 16) & 0xFFFF);
-    int32_t dsde = (((opcode[16] >> 48) & 0xFFFF) << 16) | ((opcode[18] >> 48) & 0xFFFF);
-    int32_t dtde = (((opcode[16] >> 32) & 0xFFFF) << 16) | ((opcode[18] >> 32) & 0xFFFF);
-    int32_t dwde = (((opcode[16] >> 16) & 0xFFFF) << 16) | ((opcode[18] >> 16) & 0xFFFF);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Stop the thread if it was disabled, or start it if enabled and not running
+    if (!Settings::threadedRdp && running)
     {
-        // Get the X-bounds of the triangle on the current line
-        // From Y1 to Y2, the high and middle edges are used
-        // From Y2 to Y3, the high and low edges are used
-        int xa = (x2 += slope2) >> 16;
-        int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
+        finishThread();
+    }
+    else if (Settings::threadedRdp && !running)
+    {
+        running = true;
+        thread = new std::thread(runThreaded);
+    }
 
-        // Get the interpolated values at the start of the line
-        int32_t ra = (r1 += drde);
-        int32_t ga = (g1 += dgde);
-        int32_t ba = (b1 += dbde);
-        int32_t aa = (a1 += dade);
-        int32_t sa = (s1 += dsde);
-        int32_t ta = (t1 += dtde);
-        int32_t wa = (w1 += dwde);
-
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
+    // Process RDP commands until the end address is reached
+    while (startAddr < endAddr)
+    {
+        // Add a parameter to the buffer
+        uint64_t value = Memory::read<uint64_t>(addrBase + (startAddr & addrMask));
+        std::lock_guard<std::mutex> guard(mutex);
+        params.push_back(value);
+        paramCount++;
+
+        // Handle a command once all of its parameters have been received
+        uint8_t op = (params[params.size() - paramCount] >> 56) & 0x3F;
+        if (paramCount >= paramCounts[op])
         {
-            // Draw a pixel if it's within scissor bounds
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2)
+            paramCount = 0;
+            if (paramCounts[op] == 1 && redundantState(value))
             {
-                // Update the shade color for the current pixel
-                uint8_t r = std::max(0x00, std::min(0xFF, ra >> 16));
-                uint8_t g = std::max(0x00, std::min(0xFF, ga >> 16));
-                uint8_t b = std::max(0x00, std::min(0xFF, ba >> 16));
-                uint8_t a = std::max(0x00, std::min(0xFF, aa >> 16));
-                shadeColor = (r << 24) | (g << 16) | (b << 8) | a;
-                shadeAlpha = colorToAlpha(shadeColor);
-
-                // Update the texel color for the current pixel, with perspective correction
-                if (wa >> 15)
+                // Drop state commands that wouldn't change anything
+                params.pop_back();
+            }
+            else if (skipCommand(op, params[params.size() - paramCounts[op]]))
+            {
+                // Drop primitives that only draw to a frame that won't be shown
+                params.erase(params.end() - paramCounts[op], params.end());
+            }
+            else if (running)
+            {
+                // When threaded, queue the command for the thread to run, decoding primitives before they're queued
+                if (isPrimitive(op))
                 {
-                    texelColor = getTexel(tile, sa / (wa >> 15), ta / (wa >> 15));
-                    texelAlpha = colorToAlpha(texelColor);
+                    primitives.emplace();
+                    decodeCommand(op, &params[params.size() - paramCounts[op]], primitives.back());
                 }
-
-                drawPixel(x, y);
+                trackCommand(op);
+                condVar.notify_one();
+            }
+            else
+            {
+                // Otherwise, decode and execute the command right away
+                Primitive prim;
+                decodeCommand(op, &params[0], prim);
+                opcode = &params[0];
+                primitive = &prim;
+                if (capturing || op == 0x29)
+                    captureCommand(op);
+                executeCommand(op, true);
+                params.clear();
             }
-
-            // Interpolate the values across the line
-            ra += drdx * inc;
-            ga += dgdx * inc;
-            ba += dbdx * inc;
-            aa += dadx * inc;
-            sa += dsdx * inc;
-            ta += dtdx * inc;
-            wa += dwdx * inc;
         }
+
+        // Move to the next parameter
+        startAddr += 8;
     }
 }
 
-void RDP::triDepShaTex()
+inline int32_t RDP::advance(int32_t value, int32_t step, uint32_t count)
 {
-    // Decode the base triangle parameters
-    int32_t y1 = (int16_t)(opcode[0] <<  2) >> 4; // High Y-coord
-    int32_t y2 = (int16_t)(opcode[0] >> 14) >> 4; // Middle Y-coord
-    int32_t y3 = (int16_t)(opcode[0] >> 30) >> 4; // Low Y-coord
-    int32_t slope1 = opcode[1]; // Low edge slope
-    int32_t slope2 = opcode[2]; // High edge slope
-    int32_t slope3 = opcode[3]; // Middle edge slope
-    int32_t x1 = (opcode[1] >> 32) - slope1; // Low edge X-coord
-    int32_t x2 = (opcode[2] >> 32); // High edge X-coord
-    int32_t x3 = (opcode[3] >> 32); // Middle edge X-coord
-    bool orient = (opcode[0] >> 55) & 0x1;
-
-    // Get the base triangle color components and gradients
-    int32_t r1 = (((opcode[4] >> 48) & 0xFFFF) << 16) | ((opcode[6] >> 48) & 0xFFFF);
-    int32_t g1 = (((opcode[4] >> 32) & 0xFFFF) << 16) | ((opcode[6] >> 32) & 0xFFFF);
-    int32_t b1 = (((opcode[4] >> 16) & 0xFFFF) << 16) | ((opcode[6] >> 16) & 0xFFFF);
-    int32_t a1 = (((opcode[4] >>  0) & 0xFFFF) << 16) | ((opcode[6] >>  0) & 0xFFFF);
-    int32_t drdx = (((opcode[5] >> 48) & 0xFFFF) << 16) | ((opcode[7] >> 48) & 0xFFFF);
-    int32_t dgdx = (((opcode[5] >> 32) & 0xFFFF) << 16) | ((opcode[7] >> 32) & 0xFFFF);
-    int32_t dbdx = (((opcode[5] >> 16) & 0xFFFF) << 16) | ((opcode[7] >> 16) & 0xFFFF);
-    int32_t dadx = (((opcode[5] >>  0) & 0xFFFF) << 16) | ((opcode[7] >>  0) & 0xFFFF);
-    int32_t drde = (((opcode[8] >> 48) & 0xFFFF) << 16) | ((opcode[10] >> 48) & 0xFFFF);
-    int32_t dgde = (((opcode[8] >> 32) & 0xFFFF) << 16) | ((opcode[10] >> 32) & 0xFFFF);
-    int32_t dbde = (((opcode[8] >> 16) & 0xFFFF) << 16) | ((opcode[10] >> 16) & 0xFFFF);
-    int32_t dade = (((opcode[8] >>  0) & 0xFFFF) << 16) | ((opcode[10] >>  0) & 0xFFFF);
-
-    // Get the base triangle texture coordinates and gradients
-    Tile &tile = tiles[(opcode[0] >> 48) & 0x7];
-    int32_t s1 = (((opcode[12] >> 48) & 0xFFFF) << 16) | ((opcode[14] >> 48) & 0xFFFF);
-    int32_t t1 = (((opcode[12] >> 32) & 0xFFFF) << 16) | ((opcode[14] >> 32) & 0xFFFF);
-    int32_t w1 = (((opcode[12] >> 16) & 0xFFFF) << 16) | ((opcode[14] >> 16) & 0xFFFF);
-    int32_t dsdx = (((opcode[13] >> 48) & 0xFFFF) << 16) | ((opcode[15] >> 48) & 0xFFFF);
-    int32_t dtdx = (((opcode[13] >> 32) & 0xFFFF) << 16) | ((opcode[15] >> 32) & 0xFFFF);
-    int32_t dwdx = (((opcode[13] >> 16) & 0xFFFF) << 16) | ((opcode[15] >> 16) & 0xFFFF);
-    int32_t dsde = (((opcode[16] >> 48) & 0xFFFF) << 16) | ((opcode[18] >> 48) & 0xFFFF);
-    int32_t dtde = (((opcode[16] >> 32) & 0xFFFF) << 16) | ((opcode[18] >> 32) & 0xFFFF);
-    int32_t dwde = (((opcode[16] >> 16) & 0xFFFF) << 16) | ((opcode[18] >> 16) & 0xFFFF);
-
-    // Get the base triangle depth and gradients
-    int32_t z1 = (opcode[20] >> 32);
-    int32_t dzdx = (opcode[20] >> 0);
-    int32_t dzde = (opcode[21] >> 32);
-
-    // Draw a triangle from top to bottom
-    for (int y = y1; y < y3; y++)
+    // Advance an interpolated value by several steps at once, wrapping the same as adding each step
+    return value + (uint32_t)step * count;
+}
+
+bool RDP::clipSpan(Span &span)
+{
+    // Get the range of pixels in a span that fall within scissor bounds, based on draw direction
+    int start, end;
+    if (span.inc > 0)
+    {
+        start = std::max(0, scissorX1 - span.x);
+        end = std::min(span.count, scissorX2 - span.x);
+    }
+    else
+    {
+        start = std::max(0, span.x - scissorX2 + 1);
+        end = std::min(span.count, span.x - scissorX1 + 1);
+    }
+
+    // Skip spans that are fully clipped
+    if (start >= end)
+        return false;
+
+    // Move the start of the span to the first visible pixel, and drop pixels past the last
+    span.x += start * span.inc;
+    span.count = end - start;
+    span.r = advance(span.r, span.drdx, start);
+    span.g = advance(span.g, span.dgdx, start);
+    span.b = advance(span.b, span.dbdx, start);
+    span.a = advance(span.a, span.dadx, start);
+    span.s = advance(span.s, span.dsdx, start);
+    span.t = advance(span.t, span.dtdx, start);
+    span.w = advance(span.w, span.dwdx, start);
+    span.z = advance(span.z, span.dzdx, start);
+    return true;
+}
+
+template <bool shade, bool texture, bool depth> void RDP::triangle()
+{
+    // Get the decoded triangle, copying the edges since they're stepped while drawing
+    const TriangleCommand &tri = primitive->triangle;
+    int32_t y1 = tri.y1, y2 = tri.y2, y3 = tri.y3;
+    int32_t slope1 = tri.slope1, slope2 = tri.slope2, slope3 = tri.slope3;
+    int32_t x1 = tri.x1, x2 = tri.x2, x3 = tri.x3;
+    bool orient = tri.orient;
+
+    // Set up spans with the gradients across lines, in the direction lines are drawn
+    Span span = {};
+    span.inc = (orient ? 1 : -1);
+    int32_t r1 = 0, g1 = 0, b1 = 0, a1 = 0, drde = 0, dgde = 0, dbde = 0, dade = 0;
+    int32_t s1 = 0, t1 = 0, w1 = 0, dsde = 0, dtde = 0, dwde = 0;
+    int32_t z1 = 0, dzde = 0;
+
+    if (shade)
+    {
+        // Get the base triangle color components and gradients
+        r1 = tri.r; g1 = tri.g; b1 = tri.b; a1 = tri.a;
+        span.drdx = tri.drdx; span.dgdx = tri.dgdx; span.dbdx = tri.dbdx; span.dadx = tri.dadx;
+        drde = tri.drde; dgde = tri.dgde; dbde = tri.dbde; dade = tri.dade;
+    }
+
+    if (texture)
+    {
+        // Get the base triangle texture coordinates and gradients
+        span.tile = &tiles[tri.tile];
+        s1 = tri.s; t1 = tri.t; w1 = tri.w;
+        span.dsdx = tri.dsdx; span.dtdx = tri.dtdx; span.dwdx = tri.dwdx;
+        dsde = tri.dsde; dtde = tri.dtde; dwde = tri.dwde;
+    }
+
+    if (depth)
+    {
+        // Get the base triangle depth and gradients
+        z1 = tri.z;
+        span.dzdx = tri.dzdx;
+        dzde = tri.dzde;
+    }
+
+    // Resolve the buffers and limit drawing to lines within scissor bounds and RDRAM
+    resolveBuffers();
+    int maxY = std::min<int>(scissorY2, colorLines);
+    if (depth && (zCompare || zUpdate))
+        maxY = std::min(maxY, zLines);
+
+    // Textured triangles without shade or depth differ slightly from others as a hack for sodium64's renderer
+    // Their texture coordinates lag a line behind, and spans are drawn one pixel shorter
+    bool hack = texture && !shade && !depth;
+
+    // Skip lines above the scissor bounds by advancing the edges and attributes past them in one step
+    // From Y1 to Y2, the middle edge is stepped, and from Y2 to Y3, the low edge is
+    int yStart = std::max<int>(y1, scissorY1), yEnd = std::min(y3, maxY);
+    if (yStart >= yEnd)
+        return;
+    uint32_t skip = yStart - y1;
+    x2 = advance(x2, slope2, skip);
+    x3 = advance(x3, slope3, std::max(0, std::min(yStart, y2) - y1));
+    x1 = advance(x1, slope1, std::max(0, yStart - std::max(y1, y2)));
+    r1 = advance(r1, drde, skip);
+    g1 = advance(g1, dgde, skip);
+    b1 = advance(b1, dbde, skip);
+    a1 = advance(a1, dade, skip);
+    s1 = advance(s1, dsde, skip);
+    t1 = advance(t1, dtde, skip);
+    w1 = advance(w1, dwde, skip);
+    z1 = advance(z1, dzde, skip);
+
+    // Draw a triangle from top to bottom, stopping at the lower scissor bound
+    for (int y = yStart; y < yEnd; y++)
     {
         // Get the X-bounds of the triangle on the current line
         // From Y1 to Y2, the high and middle edges are used
         // From Y2 to Y3, the high and low edges are used
         int xa = (x2 += slope2) >> 16;
         int xb = ((y < y2) ? (x3 += slope3) : (x1 += slope1)) >> 16;
-        int inc = (orient ? 1 : -1);
 
         // Get the interpolated values at the start of the line
-        int32_t ra = (r1 += drde);
-        int32_t ga = (g1 += dgde);
-        int32_t ba = (b1 += dbde);
-        int32_t aa = (a1 += dade);
-        int32_t sa = (s1 += dsde);
-        int32_t ta = (t1 += dtde);
-        int32_t wa = (w1 += dwde);
-        int32_t za = (z1 += dzde);
-
-        // Draw a line of the triangle based on orientation
-        for (int x = xa; orient ? (x <= xb) : (x >= xb); x += inc)
+        if (shade)
+        {
+            span.r = (r1 += drde);
+            span.g = (g1 += dgde);
+            span.b = (b1 += dbde);
+            span.a = (a1 += dade);
+        }
+        if (texture && hack)
+        {
+            span.s = s1; s1 += dsde;
+            span.t = t1; t1 += dtde;
+            span.w = w1; w1 += dwde;
+        }
+        else if (texture)
         {
-            // Get the current pixel's Z value
-            uint16_t z = za >> 16;
+            span.s = (s1 += dsde);
+            span.t = (t1 += dtde);
+            span.w = (w1 += dwde);
+        }
+        if (depth)
+            span.z = (z1 += dzde);
+
+        // Clip the line to scissor bounds based on orientation, and draw what's left of it
+        span.x = xa;
+        span.count = (orient ? (xb - xa) : (xa - xb)) + !hack;
+        if (!clipSpan(span))
+            continue;
+        pixelCount += span.count;
+        span.y = y;
+        span.colorLine = &colorBuffer[y * colorPitch];
+        if (depth)
+            span.zLine = &zBuffer[y * zPitch];
+        (*spanFuncs[(shade << 2) | (texture << 1) | depth])(span);
+    }
+}
 
-            // Draw a pixel if within scissor bounds and the depth test passes
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2 &&
-                (!zCompare || testDepth(x, y, z)))
-            {
-                // Update the shade color for the current pixel
-                uint8_t r = std::max(0x00, std::min(0xFF, ra >> 16));
-                uint8_t g = std::max(0x00, std::min(0xFF, ga >> 16));
-                uint8_t b = std::max(0x00, std::min(0xFF, ba >> 16));
-                uint8_t a = std::max(0x00, std::min(0xFF, aa >> 16));
-                shadeColor = (r << 24) | (g << 16) | (b << 8) | a;
-                shadeAlpha = colorToAlpha(shadeColor);
+void RDP::copyRectangle(Tile &tile, int x1, int x2, int y1, int y2, int s, int t, int dtdy)
+{
+    // Clip the rectangle to scissor bounds, and move the texture coordinates to match
+    int xs = std::max<int>(x1, scissorX1), xe = std::min<int>(x2, scissorX2);
+    int ys = std::max<int>(y1, scissorY1);
+    if (xs >= xe || ys >= y2)
+        return;
+    t += (ys - y1) * dtdy;
 
-                // Update the texel color for the current pixel, with perspective correction
-                if (wa >> 15)
-                {
-                    texelColor = getTexel(tile, sa / (wa >> 15), ta / (wa >> 15));
-                    texelAlpha = colorToAlpha(texelColor);
-                }
+    // Make sure the tile's texels are decoded, and get the first texel column
+    // With a 1:1 scale, each pixel moves exactly one texel to the right
+    (*tile.sampler)(tile, 0, 0, true);
+    int col = ((s >> 5) - tile.sBase + (xs - x1) * 0x20) >> 5;
+    uint32_t texel = 0;
 
-                // Update the Z buffer if a pixel is drawn
-                if (drawPixel(x, y) && zUpdate)
-                    Memory::write<uint16_t>(zAddress + (y * colorWidth + x) * 2, z);
+    for (int y = ys; y < y2; y++, t += dtdy)
+    {
+        // Get the texel row for the line, clamped or wrapped the same way as the sampler
+        int row = ((t >> 5) - tile.tBase) >> 5;
+        row = tile.tClamp ? std::max<int>(std::min<int>(row, tile.tWrap), 0) : (row & tile.tWrap);
+        uint32_t *texels = &tile.texels[row << tile.shift];
+        uint8_t *colorLine = &colorBuffer[y * colorPitch];
+        pixelCount += xe - xs;
+        texelCount += xe - xs;
+        drawnCount += xe - xs;
+
+        // Copy the row of texels to the color buffer, skipping transparent ones if alpha compare is enabled
+        for (int x = xs, c = col; x < xe; x++, c++)
+        {
+            texel = texels[tile.sClamp ? std::max<int>(std::min<int>(c, tile.sWrap), 0) : (c & tile.sWrap)];
+            if (alphaCompare && !(texel & 0xFF))
+            {
+                drawnCount--;
+                continue;
             }
-
-            // Interpolate the values across the line
-            ra += drdx * inc;
-            ga += dgdx * inc;
-            ba += dbdx * inc;
-            aa += dadx * inc;
-            sa += dsdx * inc;
-            ta += dtdx * inc;
-            wa += dwdx * inc;
-            za += dzdx * inc;
+            if (colorFormat == RGBA16)
+                writeBuffer<uint16_t>(&colorLine[x * 2], Pixel::rgba32To16(texel));
+            else
+                writeBuffer<uint32_t>(&colorLine[x * 4], texel);
         }
     }
+
+    // Leave the last texel for the combiner, like the per-pixel path
+    texelColor = texel;
+    texelAlpha = colorToAlpha(texelColor);
 }
 
 void RDP::texRectangle()
 {
-    // Decode the operands
-    Tile &tile = tiles[(opcode[0] >> 24) & 0x7];
-    uint16_t y1 = ((opcode[0] >>  0) & 0xFFF) >> 2;
-    uint16_t x1 = ((opcode[0] >> 12) & 0xFFF) >> 2;
-    uint16_t y2 = ((opcode[0] >> 32) & 0xFFF) >> 2;
-    uint16_t x2 = ((opcode[0] >> 44) & 0xFFF) >> 2;
-    int16_t dtdy = opcode[1] >>  0;
-    int16_t dsdx = opcode[1] >> 16;
-    int t1 = (int16_t)(opcode[1] >> 32) << 5;
-    int s1 = (int16_t)(opcode[1] >> 48) << 5;
+    // Get the decoded operands
+    const RectCommand &rect = primitive->rect;
+    Tile &tile = tiles[rect.tile];
+    uint16_t y1 = rect.y1, x1 = rect.x1;
+    uint16_t y2 = rect.y2, x2 = rect.x2;
+    int16_t dtdy = rect.dtdy;
+    int16_t dsdx = rect.dsdx;
+    int t1 = rect.t;
+    int s1 = rect.s;
 
     // Adjust some things based on the cycle type
     // TODO: handle this more accurately
@@ -1383,17 +2932,32 @@ void RDP::texRectangle()
         y2++;
     }
 
+    // Resolve the buffers and limit drawing to lines within scissor bounds and RDRAM
+    resolveBuffers();
+    int maxY = std::min<int>(scissorY2, colorLines);
+
+    // Copy 1:1 rectangles straight from decoded texels when possible
+    if (cycleType == COPY_MODE && dsdx == 0x400 && tile.cached)
+        return copyRectangle(tile, x1, x2, y1, std::min<int>(y2, maxY), s1, t1, dtdy);
+
     // Draw a rectangle using a texture
     for (int y = y1, t = t1; y < y2; y++, t += dtdy)
     {
+        // Skip lines outside of scissor bounds or RDRAM, and get a pointer to the others
+        if (y < scissorY1 || y >= maxY)
+            continue;
+        uint8_t *colorLine = &colorBuffer[y * colorPitch];
+
         for (int x = x1, s = s1; x < x2; x++, s += dsdx)
         {
             // Draw a pixel if it's within scissor bounds
-            if (x >= scissorX1 && x < scissorX2 && y >= scissorY1 && y < scissorY2)
+            if (x >= scissorX1 && x < scissorX2)
             {
-                texelColor = getTexel(tile, s >> 5, t >> 5, true);
+                pixelCount++;
+                texelCount++;
+                texelColor = (*tile.sampler)(tile, s >> 5, t >> 5, true);
                 texelAlpha = colorToAlpha(texelColor);
-                drawPixel(x, y);
+                drawnCount += (*pixelFunc)(x, colorLine);
             }
         }
     }
@@ -1419,6 +2983,7 @@ void RDP::setOtherModes()
 {
     // Set various rendering parameters
     // TODO: actually use the other bits
+    otherModes = opcode[0];
     cycleType = (CycleType)((opcode[0] >> 52) & 0x3);
     texFilter = (opcode[0] >> 45) & 0x1;
     blendA[0] = (opcode[0] >> 30) & 0x3;
@@ -1434,6 +2999,11 @@ void RDP::setOtherModes()
     zUpdate = (opcode[0] >> 5) & 0x1;
     zCompare = (opcode[0] >> 4) & 0x1;
     alphaCompare = (opcode[0] >> 0) & 0x1;
+
+    // Select new sampler and pixel functions for the modes
+    for (int i = 0; i < 8; i++)
+        updateSampler(tiles[i]);
+    updatePipeline();
 }
 
 void RDP::loadTlut()
@@ -1443,14 +3013,23 @@ void RDP::loadTlut()
     uint16_t indexL = ((opcode[0] >> 44) & 0xFFF) >> 1;
     uint16_t indexH = ((opcode[0] >> 12) & 0xFFF) >> 1;
 
+    // Skip the upload if the same lookup values are already in TMEM
+    if (indexL <= indexH && skipUpload(texAddress + indexL, indexH - indexL + 2, 1,
+        tmemBlocks((tile.address + indexL * 4) & 0xFF8, (indexH - indexL) * 4 + 8)))
+        return;
+
     // Copy 16-bit texture lookup values into TMEM
+    tmemCount += (indexL <= indexH) ? ((indexH - indexL) / 2 + 1) * 2 : 0;
     for (int i = indexL; i <= indexH; i += 2)
     {
-        uint16_t src = Memory::read<uint16_t>(texAddress + i);
+        uint16_t src = readRdram<uint16_t>(texAddress + i);
         uint8_t *dst = &tmem[(tile.address + i * 4) & 0xFF8];
         dst[0] = src >> 8;
         dst[1] = src >> 0;
     }
+
+    // Rebuild decoded texels that might use the palette
+    invalidateTexels();
 }
 
 void RDP::setTileSize()
@@ -1462,6 +3041,77 @@ void RDP::setTileSize()
     tile.tBase = ((opcode[0] >> 32) & 0xFFF) << 3;
 }
 
+const uint8_t *RDP::textureData(uint32_t address, uint32_t size)
+{
+    // Get texture data directly from RDRAM if it's in bounds
+    uint32_t pAddr = address & 0x1FFFFFFF;
+    if (pAddr < Memory::ramSize && size <= Memory::ramSize - pAddr)
+        return &Memory::rdram[pAddr];
+
+    // Copy texture data that crosses the end of RDRAM to a buffer, with 0 for anything out of bounds
+    for (uint32_t i = 0; i < size; i++)
+        loadBuffer[i] = readRdram<uint8_t>(address + i);
+    return loadBuffer;
+}
+
+void RDP::copyTmem(uint32_t address, const uint8_t *src, uint32_t size, bool swap)
+{
+    // Copy data to TMEM with wraparound, optionally swapping the 32-bit words in each 8-byte chunk
+    // Chunks are only aligned if the address is, so unaligned copies fall through to the byte loop
+    uint32_t i = 0;
+    if (!(address & 0x7))
+    {
+#ifdef __SSE2__
+        // Copy 16 bytes at once, swapping words with a shuffle
+        for (; i + 16 <= size && ((address + i) & 0xFFF) <= 0xFF0; i += 16)
+        {
+            __m128i data = _mm_loadu_si128((const __m128i*)&src[i]);
+            if (swap) data = _mm_shuffle_epi32(data, _MM_SHUFFLE(2, 3, 0, 1));
+            _mm_storeu_si128((__m128i*)&tmem[(address + i) & 0xFFF], data);
+        }
+#endif
+
+        // Copy 8 bytes at once, swapping words with a rotate
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t data;
+            memcpy(&data, &src[i], 8);
+            if (swap) data = (data >> 32) | (data << 32);
+            memcpy(&tmem[(address + i) & 0xFFF], &data, 8);
+        }
+    }
+
+    // Copy any remaining bytes one at a time
+    for (int mask = swap << 2; i < size; i++)
+        tmem[((address + i) ^ mask) & 0xFFF] = src[i];
+}
+
+void RDP::splitTexels(const uint8_t *src, uint8_t *high, uint8_t *low, uint32_t count)
+{
+    // Split 32-bit texels into their high and low 16-bit halves, for the separate TMEM banks
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // Split 4 texels at once, gathering the halves into separate 64-bit lanes
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+        data = _mm_shufflelo_epi16(data, _MM_SHUFFLE(3, 1, 2, 0));
+        data = _mm_shufflehi_epi16(data, _MM_SHUFFLE(3, 1, 2, 0));
+        data = _mm_shuffle_epi32(data, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storel_epi64((__m128i*)&high[i * 2], data);
+        _mm_storel_epi64((__m128i*)&low[i * 2], _mm_unpackhi_epi64(data, data));
+    }
+#endif
+
+    // Split any remaining texels one at a time
+    for (; i < count; i++)
+    {
+        memcpy(&high[i * 2], &src[i * 4 + 0], 2);
+        memcpy(&low[i * 2], &src[i * 4 + 2], 2);
+    }
+}
+
 void RDP::loadBlock()
 {
     // Decode the operands
@@ -1472,6 +3122,15 @@ void RDP::loadBlock()
     // Adjust the byte count based on the texel size
     count = (count << 2) >> (~texFormat & 0x3);
 
+    // Skip the upload if the same texture data is already in TMEM
+    uint64_t blocks = ((texFormat & 0x3) == 0x3) ? (tmemBlocks(tile.address, count / 2 + 4) |
+        tmemBlocks(tile.address + 0x800, count / 2 + 4)) : tmemBlocks(tile.address, count + 8);
+    if (skipUpload(texAddress, count + 16, 1, blocks))
+        return;
+
+    // Get the texture data, including the extra 8 bytes that odd lines can read for 32-bit textures
+    const uint8_t *src = textureData(texAddress, (count & ~0x7) + 16);
+    tmemCount += (count & ~0x7) + 8;
     uint16_t d = 0;
     bool odd = false;
 
@@ -1480,19 +3139,20 @@ void RDP::loadBlock()
     {
         for (int i = 0; i <= count; i += 8)
         {
-            // Read 8 bytes of texture data, swapping the 32-bit halves on odd lines
-            uint64_t src = Memory::read<uint64_t>(texAddress + (i ^ (odd << 3)));
+            // Read 8 bytes of texture data, swapping with the adjacent 8 bytes on odd lines
+            const uint8_t *data = &src[i ^ (odd << 3)];
 
             // Write 8 bytes of texture data to TMEM, split across high and low banks
             uint8_t *dstL = &tmem[(tile.address + 0x000 + i / 2) & 0xFFC];
             uint8_t *dstH = &tmem[(tile.address + 0x800 + i / 2) & 0xFFC];
-            for (int j = 0; j < 4; j += 2)
-            {
-                dstH[j + 0] = src >> (56 - j * 16);
-                dstH[j + 1] = src >> (48 - j * 16);
-                dstL[j + 0] = src >> (40 - j * 16);
-                dstL[j + 1] = src >> (32 - j * 16);
-            }
+            dstH[0] = data[0];
+            dstH[1] = data[1];
+            dstH[2] = data[4];
+            dstH[3] = data[5];
+            dstL[0] = data[2];
+            dstL[1] = data[3];
+            dstL[2] = data[6];
+            dstL[3] = data[7];
 
             // Move to the next line when the counter overflows
             uint16_t d2 = d;
@@ -1502,23 +3162,27 @@ void RDP::loadBlock()
     }
     else
     {
-        for (int i = 0; i <= count; i += 8)
+        for (int i = 0; i <= count;)
         {
-            // Read 8 bytes of texture data, swapping the 32-bit halves on odd lines
-            uint64_t src = Memory::read<uint64_t>(texAddress + i);
-            if (odd) src = (src >> 32) | (src << 32);
-
-            // Copy 8 bytes of texture data to TMEM
-            uint8_t *dst = &tmem[(tile.address + i) & 0xFF8];
-            for (int j = 0; j < 8; j++)
-                dst[j] = src >> (7 - j) * 8;
+            // Find a run of 8-byte chunks that are all on even or all on odd lines
+            int start = i;
+            bool swap = odd;
+            while (i <= count && odd == swap)
+            {
+                // Move to the next line when the counter overflows
+                uint16_t d2 = d;
+                if (((d += dxt) ^ d2) & 0x800)
+                    odd = !odd;
+                i += 8;
+            }
 
-            // Move to the next line when the counter overflows
-            uint16_t d2 = d;
-            if (((d += dxt) ^ d2) & 0x800)
-                odd = !odd;
+            // Copy the run to TMEM, swapping 32-bit words on odd lines
+            copyTmem(tile.address + start, &src[start], i - start, swap);
         }
     }
+
+    // Rebuild decoded texels from the new TMEM contents
+    invalidateTexels();
 }
 
 void RDP::loadTile()
@@ -1541,63 +3205,51 @@ void RDP::loadTile()
         return;
     }
 
-    switch (texFormat & 0x3)
+    // Skip the upload if the same texture data is already in TMEM
+    if (t1 <= t2 && s1 <= s2)
     {
-        case 0x0: // 4-bit
-            // Cut out a 4-bit texture from the texture buffer and copy it to TMEM
-            for (int t = t1; t <= t2; t++)
-            {
-                int mask = ((t - t1) & 0x1) << 2; // Swap 32-bit words on odd lines
-                for (int s = s1; s <= s2; s += 2)
-                    tmem[((tile.address + (t - t1) * tile.width + (s - s1) / 2) ^ mask) & 0xFFF] =
-                        Memory::read<uint8_t>(texAddress + (t * texWidth + s) / 2);
-            }
-            return;
-
-        case 0x1: // 8-bit
-            // Cut out an 8-bit texture from the texture buffer and copy it to TMEM
-            for (int t = t1; t <= t2; t++)
-            {
-                int mask = ((t - t1) & 0x1) << 2; // Swap 32-bit words on odd lines
-                for (int s = s1; s <= s2; s++)
-                    tmem[((tile.address + (t - t1) * tile.width + (s - s1)) ^ mask) & 0xFFF] =
-                        Memory::read<uint8_t>(texAddress + t * texWidth + s);
-            }
+        uint32_t size = ((s2 - s1 + 1) << (texFormat & 0x3)) >> 1;
+        uint64_t blocks = 0;
+        for (int t = t1; t <= t2; t++)
+        {
+            uint32_t start = (tile.address + (t - t1) * tile.width) & ~0x7;
+            blocks |= tmemBlocks(start, std::max(size, 2U) + 8);
+            if ((texFormat & 0x3) == 0x3)
+                blocks |= tmemBlocks(start + 0x800, size / 2 + 8);
+        }
+        if (skipUpload(texAddress + (((t1 * texWidth + s1) << (texFormat & 0x3)) >> 1), size + 2, t2 - t1 + 1, blocks))
             return;
+    }
 
-        case 0x2: // 16-bit
-            // Cut out a 16-bit texture from the texture buffer and copy it to TMEM
-            for (int t = t1; t <= t2; t++)
-            {
-                int mask = ((t - t1) & 0x1) << 2; // Swap 32-bit words on odd lines
-                for (int s = s1; s <= s2; s++)
-                {
-                    uint16_t src = Memory::read<uint16_t>(texAddress + (t * texWidth + s) * 2);
-                    uint8_t *dst = &tmem[((tile.address + (t - t1) * tile.width + (s - s1) * 2) ^ mask) & 0xFFE];
-                    dst[0] = src >> 8;
-                    dst[1] = src >> 0;
-                }
-            }
-            return;
+    // Copy texture data from the texture buffer to TMEM one row at a time
+    // Rows of 4-bit texels are contiguous bytes too, starting at the byte that holds the first texel
+    int bits = texFormat & 0x3;
+    uint32_t texels = s2 - s1 + 1;
+    uint32_t size = bits ? (texels << (bits - 1)) : ((s2 - s1) / 2 + 1);
+    for (int t = t1; t <= t2 && s1 <= s2; t++)
+    {
+        uint32_t address = tile.address + (t - t1) * tile.width;
+        uint32_t offset = bits ? ((t * texWidth + s1) << (bits - 1)) : ((t * texWidth + s1) / 2);
+        const uint8_t *src = textureData(texAddress + offset, size);
+        bool swap = (t - t1) & 0x1; // Swap 32-bit words on odd lines
+        tmemCount += size;
 
-        case 0x3: // 32-bit
-            // Cut out a 32-bit texture from the texture buffer and copy it to TMEM, split across high and low banks
-            for (int t = t1; t <= t2; t++)
-            {
-                int mask = ((t - t1) & 0x1) << 2; // Swap 32-bit words on odd lines
-                for (int s = s1; s <= s2; s++)
-                {
-                    uint32_t src = Memory::read<uint32_t>(texAddress + (t * texWidth + s) * 4);
-                    uint8_t *dstL = &tmem[((tile.address + 0x000 + (t - t1) * tile.width + (s - s1) * 2) ^ mask) & 0xFFE];
-                    uint8_t *dstH = &tmem[((tile.address + 0x800 + (t - t1) * tile.width + (s - s1) * 2) ^ mask) & 0xFFE];
-                    dstH[0] = src >> 24;
-                    dstH[1] = src >> 16;
-                    dstL[0] = src >>  8;
-                    dstL[1] = src >>  0;
-                }
-            }
-            return;
+        if (bits == 0x3) // 32-bit
+        {
+            // Split the row across high and low banks before copying it
+            uint8_t high[0x800], low[0x800];
+            splitTexels(src, high, low, texels);
+            copyTmem(address + 0x800, high, texels * 2, swap);
+            copyTmem(address + 0x000, low, texels * 2, swap);
+        }
+        else
+        {
+            copyTmem(address, src, size, swap);
+        }
     }
+
+    // Rebuild decoded texels from the new TMEM contents
+    invalidateTexels();
 }
 
 void RDP::setTile()
@@ -1605,6 +3257,7 @@ void RDP::setTile()
     // Set parameters for the specified tile
     // TODO: Actually use the detail shifts
     Tile &tile = tiles[(opcode[0] >> 24) & 0x7];
+    tile.command = opcode[0];
     tile.sMask = (((opcode[0] >> 4) & 0xF) ? (1 << ((opcode[0] >> 4) & 0xF)) : 0) - 1;
     tile.sMirror = ((opcode[0] >> 8) & 0x1);
     tile.sClamp = ((opcode[0] >> 9) & 0x1);
@@ -1615,15 +3268,17 @@ void RDP::setTile()
     tile.address = (opcode[0] >> 29) & 0xFF8;
     tile.width = (opcode[0] >> 38) & 0xFF8;
     tile.format = (Format)((opcode[0] >> 51) & 0x1F);
+
+    // Select a new sampler for the tile format
+    updateSampler(tile);
 }
 
 void RDP::fillRectangle()
 {
-    // Decode the operands
-    uint16_t y1 = ((opcode[0] >>  0) & 0xFFF) >> 2;
-    uint16_t x1 = ((opcode[0] >> 12) & 0xFFF) >> 2;
-    uint16_t y2 = ((opcode[0] >> 32) & 0xFFF) >> 2;
-    uint16_t x2 = ((opcode[0] >> 44) & 0xFFF) >> 2;
+    // Get the decoded operands
+    const RectCommand &rect = primitive->rect;
+    uint16_t y1 = rect.y1, x1 = rect.x1;
+    uint16_t y2 = rect.y2, x2 = rect.x2;
 
     // Adjust some things based on the cycle type
     // TODO: handle this more accurately
@@ -1639,10 +3294,48 @@ void RDP::fillRectangle()
     y1 = std::max(y1, scissorY1);
     y2 = std::min(y2, scissorY2);
 
+    // Resolve the buffers and limit drawing to lines within RDRAM
+    resolveBuffers();
+    y2 = std::min<int>(y2, colorLines);
+
+    if (cycleType == FILL_MODE && x1 < x2)
+    {
+        // Get the fill color's bytes in memory order, which repeat every 4 bytes for both 16-bit and 32-bit pixels
+        // The pattern is rotated to start at the first pixel, and extended so whole blocks can be stored at once
+        uint32_t size = (colorFormat == RGBA16) ? 2 : 4;
+        uint32_t start = x1 * size, count = (x2 - x1) * size;
+        uint8_t pattern[16];
+        for (int i = 0; i < 16; i++)
+            pattern[i] = fillColor >> ((3 - ((start + i) & 0x3)) * 8);
+
+        // Fill each line with the pattern, a block at a time
+        for (int y = y1; y < y2; y++)
+        {
+            uint8_t *dst = &colorBuffer[y * colorPitch + start];
+            pixelCount += x2 - x1;
+            drawnCount += x2 - x1;
+            uint32_t i = 0;
+#ifdef __SSE2__
+            __m128i block = _mm_loadu_si128((__m128i*)pattern);
+            for (; i + 16 <= count; i += 16)
+                _mm_storeu_si128((__m128i*)&dst[i], block);
+#endif
+            for (; i + 8 <= count; i += 8)
+                memcpy(&dst[i], pattern, 8);
+            for (; i < count; i++)
+                dst[i] = pattern[i & 0xF];
+        }
+        return;
+    }
+
     // Draw a rectangle
     for (int y = y1; y < y2; y++)
+    {
+        uint8_t *colorLine = &colorBuffer[y * colorPitch];
+        pixelCount += std::max(x2 - x1, 0);
         for (int x = x1; x < x2; x++)
-            drawPixel(x, y);
+            drawnCount += (*pixelFunc)(x, colorLine);
+    }
 }
 
 void RDP::setFillColor()
@@ -1680,6 +3373,25 @@ void RDP::setEnvColor()
 
 void RDP::setCombine()
 {
+    // Keep the combine mode for captures
+    combineMode = opcode[0];
+
+    // Use the inputs and equations of a cached combiner if the mode was decoded before
+    for (uint32_t i = 0; i < std::min(combinerCount, 32U); i++)
+    {
+        Combiner &combiner = combiners[i];
+        if (combiner.mode != combineMode)
+            continue;
+        memcpy(combineA, combiner.inputs[0], sizeof(combineA));
+        memcpy(combineB, combiner.inputs[1], sizeof(combineB));
+        memcpy(combineC, combiner.inputs[2], sizeof(combineC));
+        memcpy(combineD, combiner.inputs[3], sizeof(combineD));
+        combineKinds[0] = combiner.kinds[0];
+        combineKinds[1] = combiner.kinds[1];
+        updatePipeline();
+        return;
+    }
+
     for (int i = 0; i < 2; i++)
     {
         // Set the A input for color combiner RGB components
@@ -1819,6 +3531,32 @@ void RDP::setCombine()
             default: combineD[i] = &minColor;  break;
         }
     }
+
+    for (int i = 0; i < 2; i++)
+    {
+        // Classify the equation of each cycle, checking the RGB and alpha inputs together
+        bool zeroRgb = (combineC[i] == &minColor || combineA[i] == combineB[i]);
+        bool zeroAlpha = (combineC[i + 2] == &minColor || combineA[i + 2] == combineB[i + 2]);
+        if (zeroRgb && zeroAlpha)
+            combineKinds[i] = COMBINE_D;
+        else if (combineB[i] == &minColor && combineD[i] == &minColor && combineB[i + 2] == &minColor && combineD[i + 2] == &minColor)
+            combineKinds[i] = COMBINE_MULTIPLY;
+        else
+            combineKinds[i] = COMBINE_GENERIC;
+    }
+
+    // Cache the decoded combiner, replacing the oldest entry if full
+    Combiner &combiner = combiners[combinerCount++ & 0x1F];
+    combiner.mode = combineMode;
+    memcpy(combiner.inputs[0], combineA, sizeof(combineA));
+    memcpy(combiner.inputs[1], combineB, sizeof(combineB));
+    memcpy(combiner.inputs[2], combineC, sizeof(combineC));
+    memcpy(combiner.inputs[3], combineD, sizeof(combineD));
+    combiner.kinds[0] = combineKinds[0];
+    combiner.kinds[1] = combineKinds[1];
+
+    // Check if the combiner inputs still allow batching
+    updatePipeline();
 }
 
 void RDP::setTexImage()
@@ -1847,6 +3585,9 @@ void RDP::setColorImage()
         LOG_CRIT("Unknown RDP color buffer format: %d\n", colorFormat);
         colorFormat = RGBA16;
     }
+
+    // Select a new pixel function for the color format
+    updatePipeline();
 }
 
 void RDP::unknown()
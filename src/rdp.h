@@ -21,13 +21,51 @@
 #define RDP_H
 
 #include <cstdint>
+#include <string>
+#include <vector>
 
 namespace RDP
 {
+    // Command classes that time is measured for
+    enum StatClass
+    {
+        STAT_TRIANGLE, STAT_RECTANGLE, STAT_LOAD, STAT_STATE, STAT_MAX
+    };
+
+    // Counters collected over a frame when RDP statistics are enabled
+    struct Stats
+    {
+        uint64_t commands[0x40]; // By opcode
+        uint64_t primitives[4]; // By cycle type
+        uint64_t pixelsTested;
+        uint64_t pixelsDrawn;
+        uint64_t depthRejects;
+        uint64_t texelsFetched;
+        uint64_t tmemBytes;
+        uint64_t uploadsSkipped;
+        double times[STAT_MAX]; // In seconds
+    };
+
+    extern bool busy;
+    extern bool skipped;
+
     void reset();
     uint32_t read(int index);
     void write(int index, uint32_t value);
+
     void finishThread();
+    void waitAddress(uint32_t address);
+    void waitRange(uint32_t address, uint32_t size);
+    bool scanOut(uint32_t address, uint32_t size);
+    void readDisplay(uint32_t address);
+
+    void startCapture(std::string path, int frames);
+    bool replayCapture(const std::vector<uint8_t> &data, uint64_t &hash, uint64_t &expected, uint64_t &pixels);
+
+    void finishFrame();
+    Stats getStats();
+    std::string statsString();
+    bool dumpStats(std::string path);
 }
 
 #endif // RDP_H
@@ -0,0 +1,118 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../memory.h"
+#include "../rdp.h"
+#include "../settings.h"
+
+int main(int argc, char **argv)
+{
+    int loops = 10;
+    bool check = false;
+    std::string statsPath;
+    std::vector<std::string> paths;
+
+    // Parse the command line options and capture files
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--loops") && i + 1 < argc)
+            loops = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--check"))
+            check = true;
+        else if (!strcmp(argv[i], "--stats") && i + 1 < argc)
+            statsPath = argv[++i];
+        else
+            paths.push_back(argv[i]);
+    }
+
+    if (paths.empty())
+    {
+        printf("Usage: %s [--loops count] [--check] [--stats file.json] capture.rdp...\n", argv[0]);
+        return 1;
+    }
+
+    // Set up memory without booting anything, since captures only need the RDP
+    // Statistics add timing overhead, so they're only collected when requested
+    Memory::reset();
+    Settings::rdpStats = !statsPath.empty();
+    int failed = 0;
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        // Load a capture file into memory
+        std::vector<uint8_t> data;
+        if (FILE *file = fopen(paths[i].c_str(), "rb"))
+        {
+            fseek(file, 0, SEEK_END);
+            data.resize(ftell(file));
+            fseek(file, 0, SEEK_SET);
+            data.resize(fread(data.data(), sizeof(uint8_t), data.size(), file));
+            fclose(file);
+        }
+
+        // Replay the capture several times, timing each run
+        uint64_t hash = 0, expected = 0, pixels = 0;
+        double best = 0, total = 0;
+        bool valid = true;
+        for (int j = 0; j < loops && valid; j++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            valid = RDP::replayCapture(data, hash, expected, pixels);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = j ? std::min(best, time) : time;
+            total += time;
+        }
+
+        if (!valid)
+        {
+            printf("%s: invalid capture\n", paths[i].c_str());
+            failed++;
+            continue;
+        }
+
+        // Report the timing and pixel rate, and check the output against the captured hash if requested
+        printf("%s: %.3f ms/frame (best %.3f ms), %.2f Mpixels/s, %llu pixels, hash %016llx", paths[i].c_str(),
+            total * 1000 / loops, best * 1000, pixels * loops / total / 1000000, (unsigned long long)pixels,
+            (unsigned long long)hash);
+        if (check)
+        {
+            printf(hash == expected ? " OK" : " MISMATCH (expected %016llx)", (unsigned long long)expected);
+            failed += (hash != expected);
+        }
+        printf("\n");
+
+        // Dump statistics for the last run, numbering the files if there are several captures
+        if (!statsPath.empty())
+        {
+            RDP::finishFrame();
+            std::string path = (paths.size() > 1) ? (statsPath + "." + std::to_string(i)) : statsPath;
+            if (RDP::dumpStats(path))
+                printf("%s: %s\n", paths[i].c_str(), RDP::statsString().c_str());
+        }
+    }
+
+    return failed ? 1 : 0;
+}
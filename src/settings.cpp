@@ -38,13 +38,31 @@ namespace Settings
     int expansionPak = 1;
     int threadedRdp = 0;
     int texFilter = 1;
+    int rdpStats = 0;
+    // Frameskip doesn't replay skipped drawing, so a display buffer can show contents from an older frame
+    // the first time it's used as a texture or read by the CPU; after that, drawing to it is never skipped
+    int frameSkip = 0;
+    int threadedVi = 0;
+    int dumpBlock = 0;
+    std::string dumpPath = "";
+    int audioFilter = 0;
+    int shmPublish = 0;
+    std::string shmName = "/rokuyon";
 
     std::vector<Setting> settings =
     {
         Setting("fpsLimiter", &fpsLimiter, false),
         Setting("expansionPak", &expansionPak, false),
         Setting("threadedRdp", &threadedRdp, false),
-        Setting("texFilter", &texFilter, false)
+        Setting("texFilter", &texFilter, false),
+        Setting("rdpStats", &rdpStats, false),
+        Setting("frameSkip", &frameSkip, false),
+        Setting("threadedVi", &threadedVi, false),
+        Setting("dumpBlock", &dumpBlock, false),
+        Setting("dumpPath", &dumpPath, true),
+        Setting("audioFilter", &audioFilter, false),
+        Setting("shmPublish", &shmPublish, false),
+        Setting("shmName", &shmName, true)
     };
 }
 
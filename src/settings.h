@@ -32,6 +32,14 @@ namespace Settings
     extern int expansionPak;
     extern int threadedRdp;
     extern int texFilter;
+    extern int rdpStats;
+    extern int frameSkip;
+    extern int threadedVi;
+    extern int dumpBlock;
+    extern std::string dumpPath;
+    extern int audioFilter;
+    extern int shmPublish;
+    extern std::string shmName;
 }
 
 #endif // SETTINGS_H
@@ -0,0 +1,171 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <signal.h>
+
+#include "shm.h"
+#include "log.h"
+#include "settings.h"
+
+// Shared memory isn't available on every platform, so publishing is just never active there
+#if defined(WINDOWS) || defined(__SWITCH__)
+
+bool Shm::active() { return false; }
+uint32_t *Shm::beginFrame(uint32_t width, uint32_t height) { return nullptr; }
+void Shm::endFrame() {}
+void Shm::publishAudio(const uint32_t *samples, uint32_t count) {}
+
+#else
+
+#include "shm/shm_ring.h"
+
+namespace Shm
+{
+    ShmRing *ring;
+    std::string name;
+    bool failed;
+
+    ShmFrame *frame;
+    uint64_t frameCount;
+    uint64_t audioCount;
+
+    bool open();
+    void close();
+}
+
+bool Shm::open()
+{
+    // Publish under a name with this process's ID if another running instance already owns the configured one
+    name = Settings::shmName;
+    if (ShmRing *other = ShmReader::open(name.c_str()))
+    {
+        bool live = other->active.load() && other->pid != (uint32_t)getpid() && !kill(other->pid, 0);
+        ShmReader::close(other);
+        if (live)
+        {
+            name += "-" + std::to_string(getpid());
+            LOG_WARN("Shared memory %s is in use, publishing to %s instead\n", Settings::shmName.c_str(), name.c_str());
+        }
+    }
+
+    // Create the shared memory object, replacing one that might be left over from a crash
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(ShmRing)) < 0)
+    {
+        LOG_CRIT("Failed to create shared memory: %s\n", name.c_str());
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+
+    // Map it and fill in the header, which readers check before using anything else
+    void *memory = mmap(nullptr, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        LOG_CRIT("Failed to map shared memory: %s\n", name.c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    ring = (ShmRing*)memory;
+    frameCount = audioCount = 0;
+    ring->frameCount.store(0);
+    ring->audioCount.store(0);
+    ring->audioWriting.store(0);
+    ring->pid = getpid();
+    ring->version = SHM_VERSION;
+    ring->active.store(1);
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->magic = SHM_MAGIC;
+
+    // Remove the object on exit, so it doesn't outlive the emulator
+    static bool registered = false;
+    if (!registered) atexit(close);
+    registered = true;
+    return true;
+}
+
+void Shm::close()
+{
+    // Tell readers that nothing more is coming, and remove the object
+    if (!ring) return;
+    ring->active.store(0);
+    munmap(ring, sizeof(ShmRing));
+    shm_unlink(name.c_str());
+    ring = nullptr;
+}
+
+bool Shm::active()
+{
+    // Open or close the shared memory when the setting changes, without retrying if it failed
+    if (!Settings::shmPublish)
+    {
+        close();
+        failed = false;
+    }
+    else if (!ring && !failed)
+    {
+        failed = !open();
+    }
+    return ring;
+}
+
+uint32_t *Shm::beginFrame(uint32_t width, uint32_t height)
+{
+    // Mark the next slot as being written by making its sequence odd, and return its pixels to fill
+    frame = &ring->frames[frameCount % SHM_FRAME_SLOTS];
+    frame->sequence.store(frame->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    frame->width = std::min<uint32_t>(width, SHM_FRAME_WIDTH);
+    frame->height = std::min<uint32_t>(height, SHM_FRAME_HEIGHT);
+    frame->number = frameCount;
+    return frame->data;
+}
+
+void Shm::endFrame()
+{
+    // Make the sequence even again and publish the frame
+    frame->sequence.store(frame->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    ring->frameCount.store(++frameCount, std::memory_order_release);
+}
+
+void Shm::publishAudio(const uint32_t *samples, uint32_t count)
+{
+    // Mark the samples about to be overwritten before touching them, so readers don't trust a torn copy
+    ring->audioWriting.store(audioCount + count, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Copy samples into the ring, wrapping around as needed, and then publish the new total
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t start = (audioCount + i) % SHM_AUDIO_SAMPLES;
+        uint32_t size = std::min<uint32_t>(count - i, SHM_AUDIO_SAMPLES - start);
+        memcpy(&ring->audio[start], &samples[i], size * sizeof(uint32_t));
+        i += size;
+    }
+    audioCount += count;
+    ring->audioCount.store(audioCount, std::memory_order_release);
+}
+
+#endif
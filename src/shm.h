@@ -0,0 +1,35 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <cstdint>
+
+// Publishing of frames and audio to POSIX shared memory, for other processes to read with shm/shm_ring.h
+namespace Shm
+{
+    bool active();
+
+    uint32_t *beginFrame(uint32_t width, uint32_t height);
+    void endFrame();
+    void publishAudio(const uint32_t *samples, uint32_t count);
+}
+
+#endif // SHM_H
@@ -0,0 +1,141 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shm_ring.h"
+
+int main(int argc, char **argv)
+{
+    std::string name = "/rokuyon";
+    std::string ppmPath;
+    uint64_t limit = 0;
+
+    // Parse the command line options
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--name") && i + 1 < argc)
+            name = argv[++i];
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            limit = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--ppm") && i + 1 < argc)
+            ppmPath = argv[++i];
+        else
+        {
+            printf("Usage: %s [--name /rokuyon] [--frames count] [--ppm last.ppm]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Wait for the emulator to create the shared memory
+    ShmRing *ring = nullptr;
+    for (int i = 0; i < 100 && !(ring = ShmReader::open(name.c_str())); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!ring)
+    {
+        printf("Failed to open shared memory: %s\n", name.c_str());
+        return 1;
+    }
+
+    // Start from whatever is newest, rather than replaying old data
+    uint64_t lastFrame = ring->frameCount.load();
+    uint64_t position = ring->audioCount.load();
+    uint64_t frames = 0, missed = 0, torn = 0, samples = 0, peak = 0;
+    uint32_t width = 0, height = 0;
+    std::vector<uint32_t> pixels, copy, audio(SHM_AUDIO_SAMPLES);
+    auto second = std::chrono::steady_clock::now();
+
+    while (ring->active.load() && (!limit || frames < limit))
+    {
+        // Check the newest frame, reading its pixels in place and counting any that were skipped or torn
+        uint32_t sequence;
+        const ShmFrame *frame = ShmReader::latestFrame(ring, sequence);
+        if (frame && frame->number + 1 != lastFrame)
+        {
+            uint64_t number = frame->number;
+            uint32_t w = frame->width, h = frame->height;
+            if (!ppmPath.empty())
+                copy.assign(frame->data, frame->data + w * h);
+
+            if (ShmReader::frameValid(frame, sequence))
+            {
+                missed += number - lastFrame;
+                lastFrame = number + 1;
+                width = w;
+                height = h;
+                pixels.swap(copy);
+                frames++;
+            }
+            else
+            {
+                torn++;
+            }
+        }
+
+        // Read new audio samples, tracking the loudest one as a sign that audio is flowing
+        while (size_t count = ShmReader::readAudio(ring, position, audio.data(), audio.size()))
+        {
+            for (size_t i = 0; i < count * 2; i++)
+            {
+                int16_t value = ((int16_t*)audio.data())[i];
+                peak = std::max<uint64_t>(peak, std::abs(value));
+            }
+            samples += count;
+        }
+
+        // Report the rates once per second
+        auto now = std::chrono::steady_clock::now();
+        if (now - second >= std::chrono::seconds(1))
+        {
+            printf("%ux%u, %llu frames (%llu missed, %llu torn), %llu samples, peak %llu\n", width, height,
+                (unsigned long long)frames, (unsigned long long)missed, (unsigned long long)torn,
+                (unsigned long long)samples, (unsigned long long)peak);
+            second = now;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    // Save the last frame that was read completely
+    if (!ppmPath.empty() && width && height && pixels.size() == width * height)
+    {
+        if (FILE *file = fopen(ppmPath.c_str(), "wb"))
+        {
+            fprintf(file, "P6\n%u %u\n255\n", width, height);
+            for (uint32_t i = 0; i < width * height; i++)
+            {
+                uint8_t rgb[] = { (uint8_t)pixels[i], (uint8_t)(pixels[i] >> 8), (uint8_t)(pixels[i] >> 16) };
+                fwrite(rgb, sizeof(uint8_t), 3, file);
+            }
+            fclose(file);
+        }
+    }
+
+    printf("%llu frames (%llu missed, %llu torn), %llu samples\n", (unsigned long long)frames,
+        (unsigned long long)missed, (unsigned long long)torn, (unsigned long long)samples);
+    ShmReader::close(ring);
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+    Copyright 2022-2023 Hydr8gon
+
+    This file is part of rokuyon.
+
+    rokuyon is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    rokuyon is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Layout of the shared memory that rokuyon publishes frames and audio to, along with functions for reading it
+// This header has no other dependencies, so external programs can include it on its own
+
+#define SHM_MAGIC 0x4E4F5952 // "RYON"
+#define SHM_VERSION 2
+#define SHM_FRAME_SLOTS 3
+#define SHM_FRAME_WIDTH 1024
+#define SHM_FRAME_HEIGHT 1024
+#define SHM_AUDIO_SAMPLES 0x4000
+#define SHM_AUDIO_RATE 48000
+
+// A frame slot, guarded by a sequence counter that's odd while the slot is being written
+// Pixels are packed as (A << 24) | (B << 16) | (G << 8) | R, so they're RGBA bytes in little-endian memory
+struct ShmFrame
+{
+    std::atomic<uint32_t> sequence;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t number;
+    uint32_t data[SHM_FRAME_WIDTH * SHM_FRAME_HEIGHT];
+};
+
+// The whole shared memory object, with counters for the total frames and audio samples published
+// Audio samples are interleaved signed 16-bit stereo, left channel first, at SHM_AUDIO_RATE
+// The audio writing count is raised before samples are copied in, so readers can tell which ones might be changing
+struct ShmRing
+{
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> active;
+    uint32_t pid;
+    std::atomic<uint64_t> frameCount;
+    std::atomic<uint64_t> audioCount;
+    std::atomic<uint64_t> audioWriting;
+    uint32_t audio[SHM_AUDIO_SAMPLES];
+    ShmFrame frames[SHM_FRAME_SLOTS];
+};
+
+namespace ShmReader
+{
+    inline ShmRing *open(const char *name)
+    {
+        // Map an existing shared memory object read-only, and make sure it has the expected layout
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) return nullptr;
+        void *memory = mmap(nullptr, sizeof(ShmRing), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) return nullptr;
+
+        ShmRing *ring = (ShmRing*)memory;
+        if (ring->magic != SHM_MAGIC || ring->version != SHM_VERSION)
+        {
+            munmap(memory, sizeof(ShmRing));
+            return nullptr;
+        }
+        return ring;
+    }
+
+    inline void close(ShmRing *ring)
+    {
+        // Unmap the shared memory
+        munmap(ring, sizeof(ShmRing));
+    }
+
+    inline const ShmFrame *latestFrame(const ShmRing *ring, uint32_t &sequence)
+    {
+        // Find the newest published frame, or return null if there isn't one yet
+        // Frame data can be read in place, and should be checked with frameValid afterwards
+        uint64_t count = ring->frameCount.load(std::memory_order_acquire);
+        if (!count) return nullptr;
+        const ShmFrame *frame = &ring->frames[(count - 1) % SHM_FRAME_SLOTS];
+        sequence = frame->sequence.load(std::memory_order_acquire);
+        return (sequence & 0x1) ? nullptr : frame;
+    }
+
+    inline bool frameValid(const ShmFrame *frame, uint32_t sequence)
+    {
+        // Check that a frame wasn't overwritten while it was being read
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return frame->sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    inline size_t readAudio(const ShmRing *ring, uint64_t &position, uint32_t *out, size_t count)
+    {
+        // Skip ahead if the reader fell more than a ring behind what's being written, since those samples are gone
+        uint64_t end = ring->audioCount.load(std::memory_order_acquire);
+        uint64_t writing = ring->audioWriting.load(std::memory_order_relaxed);
+        if (writing - position > SHM_AUDIO_SAMPLES)
+            position = writing - SHM_AUDIO_SAMPLES;
+        if (position > end)
+            return 0;
+
+        // Copy as many new samples as are available, in up to two parts if they wrap around the ring
+        size_t size = (size_t)std::min<uint64_t>(end - position, count);
+        size_t start = position % SHM_AUDIO_SAMPLES;
+        size_t first = std::min<size_t>(size, SHM_AUDIO_SAMPLES - start);
+        memcpy(out, &ring->audio[start], first * sizeof(uint32_t));
+        memcpy(&out[first], ring->audio, (size - first) * sizeof(uint32_t));
+
+        // Drop the samples if the writer started overwriting any of them during the copy
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ring->audioWriting.load(std::memory_order_relaxed) - position > SHM_AUDIO_SAMPLES)
+            return 0;
+        position += size;
+        return size;
+    }
+}
+
+#endif // SHM_RING_H
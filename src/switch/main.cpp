@@ -28,6 +28,7 @@
 #include "../ai.h"
 #include "../core.h"
 #include "../pif.h"
+#include "../rdp.h"
 #include "../settings.h"
 #include "../vi.h"
 
@@ -107,7 +108,11 @@ void settingsMenu()
             ListItem("FPS Limiter", toggle[Settings::fpsLimiter]),
             ListItem("Expansion Pak", toggle[Settings::expansionPak]),
             ListItem("Threaded RDP", toggle[Settings::threadedRdp]),
-            ListItem("Texture Filter", toggle[Settings::texFilter])
+            ListItem("Texture Filter", toggle[Settings::texFilter]),
+            ListItem("RDP Statistics", toggle[Settings::rdpStats]),
+            ListItem("Frame Skip", toggle[Settings::frameSkip]),
+            ListItem("Threaded VI", toggle[Settings::threadedVi]),
+            ListItem("Sinc Resampler", toggle[Settings::audioFilter])
         };
 
         // Create the settings menu
@@ -124,6 +129,10 @@ void settingsMenu()
                 case 1: Settings::expansionPak = !Settings::expansionPak; break;
                 case 2: Settings::threadedRdp = !Settings::threadedRdp; break;
                 case 3: Settings::texFilter = !Settings::texFilter; break;
+                case 4: Settings::rdpStats = !Settings::rdpStats; break;
+                case 5: Settings::frameSkip = !Settings::frameSkip; break;
+                case 6: Settings::threadedVi = !Settings::threadedVi; break;
+                case 7: Settings::audioFilter = !Settings::audioFilter; break;
             }
         }
         else
@@ -400,8 +409,8 @@ int main()
             SwitchUI::clear(Color(0, 0, 0));
             SwitchUI::drawImage(fb->data, fb->width, fb->height, 160, 0, 960, 720, true, 0);
             if (showFps) SwitchUI::drawString(std::to_string(Core::fps) + " FPS", 5, 0, 48, Color(255, 255, 255));
+            if (Settings::rdpStats) SwitchUI::drawString(RDP::statsString(), 5, 696, 20, Color(255, 255, 255));
             SwitchUI::update();
-            delete fb;
         }
 
         // Toggle showing FPS or open the pause menu if hotkeys are pressed
@@ -17,24 +17,40 @@
     along with rokuyon. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 #include <cstring>
-#include <queue>
-#include <mutex>
 
 #include "vi.h"
 #include "core.h"
+#include "dump.h"
 #include "log.h"
 #include "memory.h"
 #include "mi.h"
+#include "pixel.h"
 #include "rdp.h"
+#include "settings.h"
+#include "shm.h"
+
+#define FRAME_FRESH 0x4
 
 namespace VI
 {
-    std::queue<_Framebuffer*> framebuffers;
-    std::atomic<bool> ready;
-    std::mutex mutex;
+    // Frames are triple buffered, so the VI and the front-end never wait on each other
+    // The middle index is swapped atomically, with a bit set when it holds a frame that hasn't been taken yet
+    uint32_t frameData[3][MAX_FB_WIDTH * MAX_FB_HEIGHT];
+    _Framebuffer framebuffers[3] = { { frameData[0] }, { frameData[1] }, { frameData[2] } };
+    std::atomic<uint8_t> middleFrame(1);
+    uint8_t backFrame = 0;
+    uint8_t frontFrame = 2;
+
+    // With threaded VI, frames hold raw pixels until the front-end takes them and converts them itself
+    uint8_t rawData[3][MAX_FB_WIDTH * MAX_FB_HEIGHT * 4];
+    uint32_t rawSizes[3];
+
+    uint32_t lastKey[6];
+    bool lastValid;
 
     uint32_t control;
     uint32_t origin;
@@ -44,21 +60,27 @@ namespace VI
     uint32_t xScale;
     uint32_t yScale;
 
+    void drawLines(_Framebuffer *fb, uint32_t size, void (*convert)(const uint8_t*, uint32_t*, uint32_t));
+    void copyLines(uint8_t *raw, uint32_t fbWidth, uint32_t fbHeight, uint32_t size);
     void drawFrame();
 }
 
 _Framebuffer *VI::getFramebuffer()
 {
-    // Wait until a new frame is ready
-    if (!ready.load())
+    // Check if a new frame is ready
+    if (!(middleFrame.load() & FRAME_FRESH))
         return nullptr;
 
-    // Get the next frame in the queue
-    mutex.lock();
-    _Framebuffer *fb = framebuffers.front();
-    framebuffers.pop();
-    ready.store(!framebuffers.empty());
-    mutex.unlock();
+    // Take the newest frame, giving the previous one back to the VI to draw into
+    frontFrame = middleFrame.exchange(frontFrame) & 0x3;
+    _Framebuffer *fb = &framebuffers[frontFrame];
+
+    // Convert raw pixels on this thread if the VI only copied them
+    switch (rawSizes[frontFrame])
+    {
+        case 4: Pixel::rgba32ToScreen(rawData[frontFrame], fb->data, fb->width * fb->height); break;
+        case 2: Pixel::rgba16ToScreen(rawData[frontFrame], fb->data, fb->width * fb->height); break;
+    }
     return fb;
 }
 
@@ -72,6 +94,10 @@ void VI::reset()
     vVideo = 0;
     xScale = 0;
     yScale = 0;
+    lastValid = false;
+
+    // Build the shared pixel format tables
+    Pixel::init();
 
     // Schedule the first frame to be drawn
     Core::schedule(drawFrame, (93750000 / 60) * 2);
@@ -150,27 +176,77 @@ void VI::write(uint32_t address, uint32_t value)
     }
 }
 
-void VI::drawFrame()
+void VI::drawLines(_Framebuffer *fb, uint32_t size, void (*convert)(const uint8_t*, uint32_t*, uint32_t))
 {
-    // Ensure the RDP thread has finished drawing
-    RDP::finishThread();
+    // The RDP is already finished with the framebuffer at this point
+    uint32_t address = origin & 0x1FFFFFFF;
+    for (uint32_t y = 0; y < fb->height; y++)
+    {
+        // Convert the part of a line that's in RDRAM, and show black for anything past it
+        uint32_t line = address + y * width * size;
+        uint32_t count = (line < Memory::ramSize) ? std::min(fb->width, (Memory::ramSize - line) / size) : 0;
+        uint32_t *data = &fb->data[y * fb->width];
+        if (count)
+            (*convert)(&Memory::rdram[line], data, count);
+        for (uint32_t x = count; x < fb->width; x++)
+            data[x] = 0xFF000000;
+    }
+}
+
+void VI::copyLines(uint8_t *raw, uint32_t fbWidth, uint32_t fbHeight, uint32_t size)
+{
+    // The RDP is already finished with the framebuffer at this point
+    uint32_t address = origin & 0x1FFFFFFF;
+    // Copy the visible part of each line, with 0 for anything past RDRAM since that converts to black
+    uint32_t pitch = fbWidth * size;
+    for (uint32_t y = 0; y < fbHeight; y++)
+    {
+        uint32_t line = address + y * width * size;
+        uint32_t count = (line < Memory::ramSize) ? std::min(fbWidth, (Memory::ramSize - line) / size) * size : 0;
+        if (count)
+            memcpy(&raw[y * pitch], &Memory::rdram[line], count);
+        memset(&raw[y * pitch + count], 0, pitch - count);
+    }
+}
 
-    // Allow up to 2 framebuffers to be queued, to preserve frame pacing if emulation runs ahead
-    if (framebuffers.size() < 2)
+void VI::drawFrame()
+{
+    // Get the framebuffer's location and size, cropping anything past the preallocated maximum
+    uint32_t address = origin & 0x1FFFFFFF;
+    uint32_t size = ((control & 0x3) == 0x3) ? 4 : 2;
+    uint32_t fbWidth = std::min<uint32_t>(((xScale ? xScale : 0x200) * hVideo) >> 10, MAX_FB_WIDTH);
+    uint32_t fbHeight = std::min<uint32_t>(((yScale ? yScale : 0x200) * vVideo) >> 10, MAX_FB_HEIGHT);
+    uint32_t bytes = fbHeight ? ((fbHeight - 1) * width + fbWidth) * size : 0;
+
+    // Tell the RDP which buffer is being shown, and keep showing the last frame if it skipped drawing this one
+    bool complete = RDP::scanOut(address, width * fbHeight * size);
+
+    // Wait for the RDP thread if it might still be drawing to the framebuffer, so all of its writes are counted
+    if (complete && RDP::busy && bytes)
+        RDP::waitRange(address, bytes);
+
+    // Keep showing the last frame if nothing changed, based on the registers and the write counts of its pages
+    // This saves converting and uploading identical frames, like on menus and loading screens
+    Memory::watchWrites();
+    uint32_t key[] = { control & 0x3, origin, width, fbWidth, fbHeight, Memory::countWrites(address, bytes) };
+    if (complete && lastValid && !memcmp(key, lastKey, sizeof(key)))
+        complete = false;
+
+    if (complete)
     {
-        // Create a new framebuffer
-        _Framebuffer *fb = new _Framebuffer();
-        fb->width  = ((xScale ? xScale : 0x200) * hVideo) >> 10;
-        fb->height = ((yScale ? yScale : 0x200) * vVideo) >> 10;
-        fb->data = new uint32_t[fb->width * fb->height];
+        // Set up the back frame, and remember what it shows
+        _Framebuffer *fb = &framebuffers[backFrame];
+        rawSizes[backFrame] = 0;
+        fb->width = fbWidth;
+        fb->height = fbHeight;
+        memcpy(lastKey, key, sizeof(key));
+        lastValid = true;
 
         // Clear the screen if there's nothing to display
         if (fb->width == 0 || fb->height == 0)
         {
             fb->width = 8;
             fb->height = 8;
-            delete[] fb->data;
-            fb->data = new uint32_t[fb->width * fb->height];
             goto clear;
         }
 
@@ -178,33 +254,25 @@ void VI::drawFrame()
         switch (control & 0x3) // Type
         {
             case 0x3: // 32-bit
-                // Translate pixels from RGB_8888 to ARGB8888
-                for (uint32_t y = 0; y < fb->height; y++)
+                // Translate pixels from RGB_8888 to ARGB8888, or leave that to the front-end if threaded
+                if (Settings::threadedVi)
                 {
-                    for (uint32_t x = 0; x < fb->width; x++)
-                    {
-                        uint32_t color = Memory::read<uint32_t>(origin + ((y * width + x) << 2));
-                        uint8_t r = (color >> 24) & 0xFF;
-                        uint8_t g = (color >> 16) & 0xFF;
-                        uint8_t b = (color >>  8) & 0xFF;
-                        fb->data[y * fb->width + x] = (0xFF << 24) | (b << 16) | (g << 8) | r;
-                    }
+                    copyLines(rawData[backFrame], fb->width, fb->height, 4);
+                    rawSizes[backFrame] = 4;
                 }
+                else
+                    drawLines(fb, 4, Pixel::rgba32ToScreen);
                 break;
 
             case 0x2: // 16-bit
-                // Translate pixels from RGB_5551 to ARGB8888
-                for (uint32_t y = 0; y < fb->height; y++)
+                // Translate pixels from RGB_5551 to ARGB8888, or leave that to the front-end if threaded
+                if (Settings::threadedVi)
                 {
-                    for (uint32_t x = 0; x < fb->width; x++)
-                    {
-                        uint16_t color = Memory::read<uint16_t>(origin + ((y * width + x) << 1));
-                        uint8_t r = ((color >> 11) & 0x1F) * 255 / 31;
-                        uint8_t g = ((color >>  6) & 0x1F) * 255 / 31;
-                        uint8_t b = ((color >>  1) & 0x1F) * 255 / 31;
-                        fb->data[y * fb->width + x] = (0xFF << 24) | (b << 16) | (g << 8) | r;
-                    }
+                    copyLines(rawData[backFrame], fb->width, fb->height, 2);
+                    rawSizes[backFrame] = 2;
                 }
+                else
+                    drawLines(fb, 2, Pixel::rgba16ToScreen);
                 break;
 
             default:
@@ -214,11 +282,44 @@ void VI::drawFrame()
                 break;
         }
 
-        // Add the frame to the queue
-        mutex.lock();
-        framebuffers.push(fb);
-        ready.store(true);
-        mutex.unlock();
+        // Publish the frame to shared memory if enabled, converting it there if the front-end was left to do it
+        if (Shm::active())
+        {
+            uint32_t *data = Shm::beginFrame(fb->width, fb->height);
+            uint32_t count = fb->width * fb->height;
+            switch (rawSizes[backFrame])
+            {
+                case 4: Pixel::rgba32ToScreen(rawData[backFrame], data, count); break;
+                case 2: Pixel::rgba16ToScreen(rawData[backFrame], data, count); break;
+                default: memcpy(data, fb->data, count * sizeof(uint32_t)); break;
+            }
+            Shm::endFrame();
+        }
+
+        // Publish the frame, replacing one that wasn't taken yet so the front-end always gets the newest
+        backFrame = middleFrame.exchange(backFrame | FRAME_FRESH) & 0x3;
+    }
+
+    // Queue the frame for dumping if enabled, copying raw pixels so conversion happens on the writer thread
+    // Every VI frame is dumped to keep the timing, repeating the last one if nothing new was shown
+    if (Dump::active())
+    {
+        if (!complete)
+        {
+            Dump::repeatFrame();
+        }
+        else if (fbWidth && fbHeight && (control & 0x3) >= 0x2)
+        {
+            if (uint8_t *raw = Dump::nextFrame(fbWidth, fbHeight, size))
+            {
+                copyLines(raw, fbWidth, fbHeight, size);
+                Dump::submitFrame();
+            }
+        }
+        else
+        {
+            Dump::blankFrame();
+        }
     }
 
     // Finish the frame and request a VI interrupt
@@ -228,4 +329,5 @@ void VI::drawFrame()
     // Schedule the next frame to be drawn
     Core::schedule(drawFrame, (93750000 / 60) * 2);
     Core::countFrame();
+    RDP::finishFrame();
 }
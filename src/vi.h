@@ -22,10 +22,11 @@
 
 #include <cstdint>
 
+#define MAX_FB_WIDTH 1024
+#define MAX_FB_HEIGHT 1024
+
 struct _Framebuffer
 {
-    ~_Framebuffer() { delete[] data; }
-
     uint32_t *data;
     uint32_t width;
     uint32_t height;
@@ -33,6 +34,7 @@ struct _Framebuffer
 
 namespace VI
 {
+    // Frames are owned by the VI, and the last one returned stays valid until the next call
     _Framebuffer *getFramebuffer();
 
     void reset();